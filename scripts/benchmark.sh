@@ -0,0 +1,64 @@
+#!/bin/sh
+# Runs the shell under weston's headless backend with synthetic application
+# lists of each size given, and prints the benchmark report for each
+#
+# Usage: benchmark.sh SHELL [APPS...]
+#
+# SHELL is the weston-desktop-matchbox executable, built with
+# -Dbenchmark=true. WESTON names the weston binary and WESTON_ARGS adds
+# options, e.g. WESTON_ARGS=--renderer=pixman
+set -eu
+
+shell=$(realpath "$1")
+shift
+[ $# -gt 0 ] || set -- 10 500 5000
+
+weston=${WESTON:-weston}
+timeout=${BENCHMARK_TIMEOUT:-120}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+if [ -z "${XDG_RUNTIME_DIR:-}" ]; then
+  export XDG_RUNTIME_DIR="$dir"
+fi
+
+cat > "$dir/weston.ini" <<INI
+[core]
+shell=desktop-shell.so
+
+[shell]
+client=$shell
+launcher-helper=false
+INI
+
+status=0
+for apps in "$@"; do
+  report="$dir/report-$apps"
+  WESTON_DESKTOP_MATCHBOX_BENCHMARK=$apps \
+  WESTON_DESKTOP_MATCHBOX_BENCHMARK_REPORT=$report \
+    "$weston" --backend=headless --width=1920 --height=1080 \
+      --socket="wdm-benchmark-$$" -c "$dir/weston.ini" ${WESTON_ARGS:-} \
+      > "$dir/weston-$apps.log" 2>&1 &
+  pid=$!
+
+  # weston restarts the shell when it exits, so stop it as soon as the
+  # report is written
+  waited=0
+  while [ ! -e "$report" ] && kill -0 $pid 2> /dev/null &&
+        [ $waited -lt $((timeout * 10)) ]; do
+    sleep 0.1
+    waited=$((waited + 1))
+  done
+  kill $pid 2> /dev/null || true
+  wait $pid 2> /dev/null || true
+
+  if [ -e "$report" ]; then
+    cat "$report"
+    echo
+  else
+    echo "No report with $apps applications, weston log:" >&2
+    cat "$dir/weston-$apps.log" >&2
+    status=1
+  fi
+done
+exit $status
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Checks that the memory of the shell stays bounded while its output is
+# unplugged and plugged back in over and over, using the benchmark harness
+#
+# Usage: hotplug-test.sh SHELL
+#
+# HOTPLUG_CYCLES sets the number of cycles and HOTPLUG_RSS_LIMIT the growth
+# in KiB allowed between the first and the last of them. Skips when weston
+# isn't installed
+set -eu
+
+command -v "${WESTON:-weston}" > /dev/null || exit 77
+
+report=$(WESTON_DESKTOP_MATCHBOX_BENCHMARK_HOTPLUG=${HOTPLUG_CYCLES:-100} \
+  "$(dirname "$0")/benchmark.sh" "$1" 500)
+printf '%s\n' "$report"
+
+# The line is "Hotplug: N cycles, resident FIRST KiB -> LAST KiB"
+printf '%s\n' "$report" | awk -v limit="${HOTPLUG_RSS_LIMIT:-2048}" '
+  $1 == "Hotplug:" {
+    found = 1
+    growth = $8 - $5
+  }
+  END {
+    if (!found) {
+      print "No hotplug results in the report" > "/dev/stderr"
+      exit 1
+    }
+    if (growth > limit) {
+      printf "Resident memory grew by %d KiB, more than %d KiB\n", growth,
+             limit > "/dev/stderr"
+      exit 1
+    }
+  }'
@@ -7,659 +7,6909 @@
 
 #include <cairo.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gdesktopappinfo.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
 #include <glob.h>
 #include <linux/input.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <math.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-cursor.h>
+#include <xkbcommon/xkbcommon.h>
 
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+#include <wayland-egl.h>
+#endif
+#ifdef HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "fractional-scale-v1.h"
 #include "viewporter.h"
 #include "weston-desktop-shell.h"
+#include "xdg-activation-v1.h"
 #include "xdg-shell.h"
 
+enum background_type {
+  BACKGROUND_SCALE,
+  BACKGROUND_SCALE_CROP,
+  BACKGROUND_TILE,
+  BACKGROUND_CENTERED,
+};
+
+// Height of the panel in surface coordinates, and the space around its widgets
+#define PANEL_HEIGHT (32)
+#define PANEL_PADDING (8)
+#define PANEL_FONT_SIZE (14)
+// panel-position value that turns the panel off
+#define PANEL_POSITION_NONE (-1)
+
 #define MENU_PADDING (10)
+#define MENU_FONT_SIZE (20)
+// Height of the wl_shm buffers of a menu that scrolls, in surface heights
+#define MENU_STRIP_SCREENS (2)
 
 static struct wl_display *display;
 static struct wl_registry *registry;
 static struct wl_compositor *compositor;
 static struct wl_shm *shm;
-static struct wl_cursor_theme *cursor_theme;
 static struct weston_desktop_shell *desktop_shell;
 static struct xdg_wm_base *xdg_wm_base;
 static struct wp_viewporter *viewporter;
-static struct wl_surface *cursor_surface;
-static struct wl_cursor *current_cursor;
+static struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
+static struct xdg_activation_v1 *xdg_activation;
+static struct wl_subcompositor *subcompositor;
+static struct xkb_context *xkb_context;
 static struct wl_list seat_list;
-static GList *application_list;
+// The struct app_entry for each menu row, in order
+static GPtrArray *application_list;
 static bool need_roundtrip = true;
 
+static struct {
+  // The backdrop is rendered at the output size divided by this and scaled up
+  // by the compositor. 0 renders a single pixel, which is all a solid fill
+  // needs
+  int background_downscale;
+  // File that a line is appended to for every profiled launch
+  char *launch_log;
+  // Launch applications from a helper process forked at startup
+  bool launcher_helper;
+  // IDs of applications whose executables the helper reads into the page cache
+  char **launcher_preload;
+  // Image shown on every output, or NULL for a solid background-color, and
+  // how it is fitted to the output
+  char *background_image;
+  enum background_type background_type;
+  // 0xAARRGGBB, the alpha is ignored
+  uint32_t background_color;
+  // Seconds without input before caches and spare buffers are dropped, or 0
+  int idle_timeout;
+  // A weston_desktop_shell_panel_position or PANEL_POSITION_NONE
+  int panel_position;
+  // IDs of the applications with a shortcut on the panel
+  char **panel_launchers;
+  // Number of the most used applications pinned at the top of the menu
+  int menu_frequent;
+  // File the trace is written to, when built with tracing
+  char *trace_file;
+  // Cursor theme, or NULL for the default, and its size at scale 1
+  char *cursor_theme;
+  int cursor_size;
+} config;
+
 struct background;
 struct buffer;
+struct menu;
+struct menu_render;
+struct panel;
+struct row_cache;
 struct seat;
 
+#define SWAPCHAIN_MAX_BUFFERS (3)
+
+// A fixed set of buffers for a surface. When all of them are held by the
+// compositor drawing waits for one to be released rather than allocating more
+struct swapchain {
+  struct shm_pool *pool;
+  struct buffer *buffers[SWAPCHAIN_MAX_BUFFERS];
+  // The buffer most recently presented. It always holds a complete frame, so
+  // it is the source for content that doesn't need to be repainted
+  struct buffer *front;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t format;
+  // Set when an acquire failed because every buffer was busy
+  bool stalled;
+  void (*on_release)(void *);
+  void *data;
+  struct {
+    unsigned allocations;
+    unsigned reuses;
+    unsigned stalls;
+  } stats;
+};
+
+// A wl_shm_pool backed by a single memfd that grows as needed. Buffers are
+// sub-allocated from it so that creating one doesn't require a new file
+// descriptor and mapping on both sides of the connection
+struct shm_pool {
+  int fd;
+  struct wl_shm_pool *pool;
+  void *data;
+  size_t size;
+  // Unused ranges of the pool, sorted by offset
+  struct wl_list free_ranges;
+  // Every struct buffer allocated from the pool, including dropped ones the
+  // compositor hasn't released yet
+  struct wl_list buffers;
+};
+
+struct pool_range {
+  struct wl_list link;
+  size_t offset;
+  size_t size;
+};
+
 struct output {
   struct wl_list link;
+  // Name of the wl_output global
+  uint32_t name;
   struct wl_output *output;
   struct background *background;
+  struct panel *panel;
+  // The search window, while it is open
+  struct search *search;
+  struct shm_pool pool;
   uint32_t width;
   uint32_t height;
+  int32_t scale;
 };
 static struct wl_list output_list;
 
+// Scrolling from one wl_pointer.frame
+struct pointer_scroll {
+  // A wl_pointer_axis_source, or -1 if the compositor didn't say
+  int32_t source;
+  uint32_t time;
+  double dx;
+  double dy;
+  // Set when the vertical axis stopped, e.g. the fingers left the touchpad
+  bool stop;
+};
+
 struct desktop_surface {
   void (*configure)(void *, struct weston_desktop_shell *, uint32_t,
                     struct wl_surface *, int32_t, int32_t);
   char const *cursor;
-  double cursor_x;
-  double cursor_y;
+  // Output the surface is shown on, which sets the scale of the cursor
+  struct output *output;
   void (*on_cursor_motion)(void *, struct seat *);
   void (*on_cursor_enter)(void *, struct seat *);
   void (*on_cursor_leave)(void *, struct seat *);
   void (*on_pointer_button)(void *, struct seat *, uint32_t, uint32_t);
-  void (*on_pointer_axis)(void *, struct seat *, uint32_t, double);
+  void (*on_pointer_scroll)(void *, struct seat *,
+                            struct pointer_scroll const *);
   void (*on_pointer_frame)(void *, struct seat *);
+  // Called for each key press with the keysym and the text it produces
+  void (*on_key)(void *, struct seat *, xkb_keysym_t, char const *);
+  void (*on_keyboard_leave)(void *, struct seat *);
 };
 
 struct seat {
+  struct wl_list link;
+  // Name of the wl_seat global
+  uint32_t name;
   struct wl_seat *seat;
   struct {
     struct wl_pointer *pointer;
     struct desktop_surface *surface;
+    // Position on surface in surface coordinates, or -1 when it is NULL
+    double x;
+    double y;
+    // The seat's cursor surface, the cursor shown on it and the image of that
+    // cursor that is attached
+    struct wl_surface *cursor_surface;
+    struct wl_cursor *cursor;
+    struct wl_cursor_image *cursor_image;
+    // Pending while an animated cursor is shown
+    struct wl_callback *cursor_frame;
+    // When the animation started, in milliseconds
+    int64_t cursor_start;
+    // Axis events received since the last frame
+    struct pointer_scroll scroll;
+    bool has_scroll;
   } pointer;
+  // Serial of the last button or key press, which launches are credited to
+  uint32_t serial;
+  struct {
+    struct wl_keyboard *keyboard;
+    struct desktop_surface *surface;
+    struct xkb_keymap *keymap;
+    struct xkb_state *state;
+    int32_t repeat_rate;
+    int32_t repeat_delay;
+    uint32_t repeat_key;
+    guint repeat_source;
+  } keyboard;
 };
 
+// The backdrop covering an output. It only changes when the output is
+// reconfigured
 struct background {
   struct desktop_surface base;
   struct output *output;
   struct wl_surface *surface;
-  // struct wp_viewport *viewport;
-  struct wl_list buffers;
+  struct wp_viewport *viewport;
+  struct swapchain swapchain;
+  uint32_t width;
+  uint32_t height;
+  bool needs_draw;
+  // The background-image, used instead of the swapchain, and its size in
+  // pixels
+  struct wl_buffer *wallpaper;
+  uint32_t wallpaper_width;
+  uint32_t wallpaper_height;
+  // Set while the image is prepared at the size of load_width by load_height
+  GCancellable *wallpaper_load;
+  uint32_t load_width;
+  uint32_t load_height;
+  // Set when the image can't be loaded, leaving the solid fill
+  bool wallpaper_failed;
+  struct menu *menu;
+};
+
+// A window that takes the keyboard input that filters the menu of an output
+struct search {
+  struct desktop_surface base;
+  struct output *output;
+  struct wl_surface *surface;
+  struct xdg_surface *xdg_surface;
+  struct xdg_toplevel *toplevel;
+  struct swapchain swapchain;
+  int32_t scale;
+  bool configured;
+  bool needs_draw;
+};
+
+// The application launcher list, drawn on a subsurface of the background
+struct menu {
+  struct desktop_surface base;
+  struct background *background;
+  struct wl_surface *surface;
+  struct wl_subsurface *subsurface;
+  struct wp_viewport *viewport;
+  struct wp_fractional_scale_v1 *fractional_scale;
+  // Scale the compositor asked for in 120ths, or 0 to use the output scale
+  uint32_t preferred_scale_120;
+  double scale;
+  // The buffers have a pool of their own, since the render worker draws into
+  // them and the pool can't be remapped then
+  struct shm_pool *pool;
+  struct swapchain swapchain;
+  // The frame a render worker is drawing, or NULL
+  struct menu_render *render;
+  // Size of the surface
+  uint32_t logical_width;
+  uint32_t logical_height;
+  // Size of the buffers. Everything below is in buffer pixels, apart from the
+  // pointer position
   uint32_t width;
   uint32_t height;
+  // Height of the wl_shm buffers, which hold a strip of the list taller than
+  // the surface so that scrolling within it only moves the viewport
+  uint32_t strip_height;
   double y_scroll;
+  // Scrolling received since the last draw, which applies it
+  double pending_scroll;
+  // Speed of touchpad scrolling in pixels per millisecond, and the time of
+  // the last touchpad event
+  double finger_velocity;
+  uint32_t finger_time;
+  // Speed of kinetic scrolling, 0 if it isn't running, and the timestamp of
+  // the frame that last advanced it, 0 before the first
+  double kinetic_velocity;
+  uint32_t kinetic_time;
   struct wl_callback *frame;
   bool needs_draw;
   cairo_font_extents_t extents;
+  struct row_cache *rows;
+  // Set when the rows have changed and everything needs to be repainted
+  bool needs_full_draw;
+  // Text typed to filter the menu, and its case folded form. The filter is
+  // inactive when it is empty
+  GString *query;
+  char *folded_query;
+  // Rows of application_list that match the filter, or NULL if it is inactive
+  GArray *matches;
+  // Rows under the pointers of the seats on the menu, recomputed on each draw
+  GArray *hover_rows;
+#ifdef HAVE_TRACING
+  // When the pending frame callback was requested
+  gint64 frame_requested;
+#endif
+#ifdef HAVE_EGL
+  // Used instead of the swapchain when EGL is available
+  struct wl_egl_window *egl_window;
+  EGLSurface egl_surface;
+  // Set once the EGL surface shows a frame at its current size
+  bool egl_drawn;
+#endif
+  // State that was used to draw the front buffer
+  GArray *drawn_hover_rows;
+  double drawn_y_scroll;
+  // Position in the list of the top of the front buffer
+  int drawn_strip_top;
+  // The struct app_entry shown in each row
+  GPtrArray *drawn_rows;
 };
 
 struct buffer {
   struct wl_list link;
   struct wl_buffer *buffer;
+  // Owning swapchain, or NULL if the buffer was dropped while busy and should
+  // be freed when released
+  struct swapchain *swapchain;
   bool busy;
   uint32_t width;
   uint32_t height;
   uint32_t stride;
   uint32_t format;
   size_t size;
-  void *data;
+  struct shm_pool *pool;
+  size_t offset;
+  // Area of the buffer that is out of date compared to the last frame drawn
+  cairo_region_t *damage;
+};
+
+// Menu rows rendered as alpha masks and keyed by the text they show. The same
+// mask is used for the normal and highlighted variants of a row by painting it
+// with a different source colour
+struct row_cache {
+  struct wl_list link;
+  int refcount;
+  // Scale in 120ths, as used by the fractional scale protocol
+  uint32_t scale_120;
+  double scale;
+  // Space either side of the text, in pixels at this scale
+  int padding;
+  cairo_font_extents_t extents;
+  cairo_surface_t *layout_surface;
+  cairo_t *layout;
+  GHashTable *rows;
 };
 
 static void draw_background(struct background *background);
+static void draw_menu(struct menu *menu);
+#ifdef HAVE_BENCHMARK
+static void benchmark_draw_started(struct menu *menu);
+static void benchmark_frame_drawn(struct menu *menu);
+static void benchmark_frame_done(struct menu *menu);
+#endif
+static void menu_reload(struct menu *menu);
 
-static void launch_app(GAppInfo *app) {
-  GError *error = NULL;
-  if (!g_app_info_launch(app, NULL, NULL, &error)) {
-    fprintf(stderr, "Unable to launch '%s': %s\n", g_app_info_get_name(app),
-            error->message);
-  }
+// Tracing
+//
+// Built with the tracing option, the shell writes a Chrome trace (JSON array
+// format, which Perfetto and chrome://tracing both open) to trace-file. Spans
+// on a thread are complete events and latencies that cross callbacks, like
+// frame callbacks and launches, are async events. The file is flushed on exit
+// and the array may be left unterminated if the shell crashes, which both
+// viewers accept. Without the option the macros compile to nothing
+#ifdef HAVE_TRACING
+static FILE *trace_file;
 
-  g_clear_error(&error);
-}
+// Starts a span that TRACE_END finishes
+#define TRACE_BEGIN(start) gint64 start = g_get_monotonic_time()
+#define TRACE_END(start, name) trace_complete(name, start)
+// Records the current time in a field that only exists with tracing
+#define TRACE_STAMP(field) ((field) = g_get_monotonic_time())
 
-// Buffer
-static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
-  struct buffer *buffer = data;
-  buffer->busy = false;
+static void trace_string(char const *text) {
+  fputc('"', trace_file);
+  for (char const *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(trace_file, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(trace_file, "\\u%04x", *c);
+    } else {
+      fputc(*c, trace_file);
+    }
+  }
+  fputc('"', trace_file);
 }
 
-static const struct wl_buffer_listener buffer_listener = {
-    buffer_release,
-};
-
-static struct buffer *create_buffer(uint32_t width, uint32_t height,
-                                    uint32_t stride, uint32_t format) {
-  int fd = memfd_create("buffer", MFD_CLOEXEC);
-  if (fd < 0) {
-    perror("Unable to create memfd");
-    return NULL;
+static void trace_complete(char const *name, gint64 start) {
+  if (!trace_file) {
+    return;
   }
+  gint64 now = g_get_monotonic_time();
+  flockfile(trace_file);
+  fputs("{\"name\":", trace_file);
+  trace_string(name);
+  fprintf(trace_file,
+          ",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT
+          ",\"pid\":%d,\"tid\":%d},\n",
+          start, now - start, getpid(), gettid());
+  funlockfile(trace_file);
+}
 
-  size_t size = height * stride;
-
-  if (ftruncate(fd, size)) {
-    perror("Unable to truncate memfd");
-    close(fd);
-    return NULL;
+// Records a span from start to end identified by id, with an optional detail
+static void trace_async(char const *name, char const *detail, uint64_t id,
+                        gint64 start, gint64 end) {
+  if (!trace_file) {
+    return;
   }
-
-  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (data == MAP_FAILED) {
-    perror("Unable to map memfd");
-    close(fd);
-    return NULL;
+  flockfile(trace_file);
+  for (int i = 0; i < 2; i++) {
+    fputs("{\"name\":", trace_file);
+    trace_string(name);
+    fprintf(trace_file,
+            ",\"cat\":\"async\",\"ph\":\"%c\",\"id\":\"0x%" G_GINT64_MODIFIER
+            "x\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d",
+            i ? 'e' : 'b', (guint64)id, i ? end : start, getpid(), gettid());
+    if (detail && !i) {
+      fputs(",\"args\":{\"detail\":", trace_file);
+      trace_string(detail);
+      fputc('}', trace_file);
+    }
+    fputs("},\n", trace_file);
   }
+  funlockfile(trace_file);
+}
 
-  struct buffer *buffer = calloc(1, sizeof(*buffer));
+static void init_tracing(void) {
+  if (!config.trace_file) {
+    return;
+  }
+  trace_file = fopen(config.trace_file, "w");
+  if (!trace_file) {
+    perror("Unable to open trace file");
+    return;
+  }
+  fprintf(trace_file,
+          "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"weston-desktop-matchbox\"}},\n",
+          getpid());
+}
 
-  struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-  buffer->buffer =
-      wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
-  wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
-  wl_shm_pool_destroy(pool);
-  close(fd);
+static void finish_tracing(void) {
+  if (!trace_file) {
+    return;
+  }
+  fprintf(trace_file,
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"name\":\"main\"}}\n]\n",
+          getpid(), gettid());
+  fclose(trace_file);
+  trace_file = NULL;
+}
+#else
+#define TRACE_BEGIN(start)
+#define TRACE_END(start, name)
+#define TRACE_STAMP(field)
+#endif
 
-  buffer->width = width;
-  buffer->height = height;
-  buffer->stride = stride;
-  buffer->format = format;
-  buffer->size = size;
-  buffer->data = data;
+// Applications
+struct app_entry {
+  // Desktop file ID. Applications without one aren't stored in the index
+  char *id;
+  char *name;
+  // Key the menu is sorted by
+  char *sort_key;
+  // Width of the menu row showing name, or 0 if it hasn't been measured
+  int width;
+  // NULL for entries loaded from the index until it is looked up
+  GAppInfo *info;
+};
 
-  return buffer;
+static struct app_entry *create_app_entry(char const *id, char const *name,
+                                          char const *sort_key) {
+  struct app_entry *entry = calloc(1, sizeof(*entry));
+  entry->id = g_strdup(id);
+  entry->name = g_strdup(name);
+  entry->sort_key =
+      sort_key ? g_strdup(sort_key) : g_utf8_collate_key(name, -1);
+  return entry;
 }
 
-static void free_buffer(struct buffer *buffer) {
-  munmap(buffer->data, buffer->size);
-  wl_buffer_destroy(buffer->buffer);
-  free(buffer);
+static struct app_entry *app_entry_from_info(GAppInfo *app) {
+  struct app_entry *entry = create_app_entry(
+      g_app_info_get_id(app), g_app_info_get_name(app), NULL);
+  entry->info = g_object_ref(app);
+  return entry;
 }
 
-static void attach_buffer(struct wl_surface *surface, struct buffer *buffer,
-                          int32_t x, int32_t y) {
-  wl_surface_attach(surface, buffer->buffer, x, y);
-  buffer->busy = true;
+static void free_app_entry(gpointer data) {
+  struct app_entry *entry = data;
+  g_free(entry->id);
+  g_free(entry->name);
+  g_free(entry->sort_key);
+  g_clear_object(&entry->info);
+  free(entry);
 }
 
-// Cursor
-static void set_cursor(char const *name, struct seat *seat, uint32_t serial) {
-  if (current_cursor && strcmp(current_cursor->name, name) == 0) {
-    return;
-  }
-  struct wl_cursor *cursor = wl_cursor_theme_get_cursor(cursor_theme, name);
-  if (!cursor) {
-    return;
+// Returns the GAppInfo for an entry, parsing its desktop file if it came from
+// the index and hasn't been looked up yet
+static GAppInfo *app_entry_info(struct app_entry *entry) {
+  if (!entry->info && entry->id) {
+    GDesktopAppInfo *info = g_desktop_app_info_new(entry->id);
+    if (info) {
+      entry->info = G_APP_INFO(info);
+    }
   }
-  current_cursor = cursor;
-  struct wl_buffer *buffer =
-      wl_cursor_image_get_buffer(current_cursor->images[0]);
-  wl_surface_attach(cursor_surface, buffer, 0, 0);
-  wl_surface_commit(cursor_surface);
-  wl_pointer_set_cursor(seat->pointer.pointer, serial, cursor_surface,
-                        current_cursor->images[0]->hotspot_x,
-                        current_cursor->images[0]->hotspot_y);
+  return entry->info;
 }
 
-// Desktop Shell
-static void desktop_shell_configure(
-    void *data, struct weston_desktop_shell *weston_desktop_shell,
-    uint32_t edges, struct wl_surface *surface, int32_t width, int32_t height) {
+// Entries without a GAppInfo came from the index or an earlier scan, which
+// only keep the visible ones
+static bool app_entry_visible(struct app_entry *entry) {
+  return !entry->info || g_app_info_should_show(entry->info);
+}
 
-  struct desktop_surface *s = wl_surface_get_user_data(surface);
-  s->configure(s, weston_desktop_shell, edges, surface, width, height);
+static void free_app_list(GPtrArray *apps) {
+  for (guint i = 0; i < apps->len; i++) {
+    free_app_entry(apps->pdata[i]);
+  }
+  g_ptr_array_free(apps, TRUE);
 }
 
-static void desktop_shell_prepare_lock_surface(
-    void *data, struct weston_desktop_shell *weston_desktop_shell) {
-  // No lock screen implemented, unlock immediately
-  weston_desktop_shell_unlock(desktop_shell);
+// Compares two elements of an array of struct app_entry pointers
+static int sort_apps(gconstpointer a, gconstpointer b) {
+  struct app_entry *const *entry_a = a;
+  struct app_entry *const *entry_b = b;
+
+  return strcmp((*entry_a)->sort_key, (*entry_b)->sort_key);
 }
 
-static void
-desktop_shell_grab_cursor(void *data,
-                          struct weston_desktop_shell *weston_desktop_shell,
-                          uint32_t cursor) {}
+// Launch profiling
+#define LAUNCH_PROFILE_TIMEOUT (30)
+#define LATENCY_BUCKETS (16)
 
-static const struct weston_desktop_shell_listener desktop_shell_listener = {
-    desktop_shell_configure,
-    desktop_shell_prepare_lock_surface,
-    desktop_shell_grab_cursor,
+// Latencies in power of two millisecond buckets. Bucket 0 holds everything
+// under 1 ms and the last bucket everything that doesn't fit the others
+struct latency_histogram {
+  char const *name;
+  unsigned counts[LATENCY_BUCKETS];
+  unsigned total;
+  double sum_ms;
+  double max_ms;
 };
 
-// SHM
-static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format) {}
+static struct latency_histogram spawn_latency = {.name = "click to spawn"};
 
-static const struct wl_shm_listener shm_listener = {
-    shm_format,
+// Timestamps for one launch, from g_get_monotonic_time(). Zero if the event
+// hasn't happened. The first window of the application isn't among them:
+// applications get an xdg-activation token, but the compositor never tells
+// the client that requested it when it is used, and the desktop shell
+// protocol doesn't report other clients' windows either
+struct launch_record {
+  struct wl_list link;
+  char *name;
+  GAppInfo *app;
+  pid_t pid;
+  gint64 click;
+  gint64 spawn;
+  gint64 exit;
+  guint timeout;
+  // Set while waiting for the activation token
+  struct xdg_activation_token_v1 *token;
+  // Watches applications that aren't children of the shell, or -1 and 0
+  int pidfd;
+  guint exit_watch;
 };
 
-// Background surface
-static void background_enter_output(void *data, struct wl_surface *wl_surface,
-                                    struct wl_output *output) {}
-static void background_leave_output(void *data, struct wl_surface *wl_surface,
-                                    struct wl_output *output) {}
+static struct wl_list pending_launches = {&pending_launches, &pending_launches};
 
-static const struct wl_surface_listener background_surface_listener = {
-    background_enter_output,
-    background_leave_output,
-};
+static void histogram_add(struct latency_histogram *histogram, double ms) {
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && ms >= (1 << bucket)) {
+    bucket++;
+  }
+  histogram->counts[bucket]++;
+  histogram->total++;
+  histogram->sum_ms += ms;
+  histogram->max_ms = fmax(histogram->max_ms, ms);
+}
 
-static void background_frame_done(void *data, struct wl_callback *wl_callback,
-                                  uint32_t callback_data) {
-  struct background *background = data;
-  wl_callback_destroy(background->frame);
-  background->frame = NULL;
-  if (background->needs_draw) {
-    draw_background(background);
+static void histogram_print(struct latency_histogram *histogram, FILE *f) {
+  if (!histogram->total) {
+    fprintf(f, "%s: no samples\n", histogram->name);
+    return;
   }
+
+  fprintf(f, "%s: %u samples, mean %.1f ms, max %.1f ms\n", histogram->name,
+          histogram->total, histogram->sum_ms / histogram->total,
+          histogram->max_ms);
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    if (!histogram->counts[i]) {
+      continue;
+    }
+    if (i == LATENCY_BUCKETS - 1) {
+      fprintf(f, "  >= %5d ms: %u\n", 1 << (i - 1), histogram->counts[i]);
+    } else {
+      fprintf(f, "  <  %5d ms: %u\n", 1 << i, histogram->counts[i]);
+    }
+  }
+}
+
+static gboolean print_launch_stats(gpointer data) {
+  histogram_print(&spawn_latency, stderr);
+  return G_SOURCE_CONTINUE;
+}
+
+static double record_ms(struct launch_record *record, gint64 time) {
+  return (time - record->click) / 1000.0;
 }
 
-static const struct wl_callback_listener background_frame_listener = {
-    background_frame_done,
+// Search
+//
+// Finds the applications whose names contain a query. The names are case
+// folded and every 1, 2 and 3 byte substring of them is indexed, so a query
+// only has to check the applications that contain its rarest trigram. When a
+// query extends the previous one, only the previous matches are checked
+struct search_index {
+  bool valid;
+  // Case folded name of each entry in application_list
+  GPtrArray *folded;
+  // Packed n-gram to a GArray of the rows that contain it, in ascending order
+  GHashTable *grams;
 };
 
-static void draw_background(struct background *background) {
-  if (background->frame) {
-    // Can't draw right now. Flag as needing to redraw when the frame callback
-    // finishes
-    background->needs_draw = true;
+static struct search_index search_index;
+
+static char *fold_text(char const *text) {
+  char *normalized = g_utf8_normalize(text, -1, G_NORMALIZE_ALL);
+  char *folded = g_utf8_casefold(normalized ? normalized : text, -1);
+  g_free(normalized);
+  return folded;
+}
+
+// Packs up to 3 bytes into a key. Text never contains NUL bytes, so n-grams of
+// different lengths can't collide
+static guint search_gram_key(char const *p, int n) {
+  guint key = 0;
+  for (int i = 0; i < n; i++) {
+    key |= (guint)(guint8)p[i] << (8 * i);
+  }
+  return key;
+}
+
+// Called whenever application_list changes
+static void search_index_invalidate(void) {
+  if (!search_index.valid) {
     return;
   }
-  background->needs_draw = false;
+  g_ptr_array_free(search_index.folded, TRUE);
+  g_hash_table_destroy(search_index.grams);
+  search_index.valid = false;
+}
 
-  struct buffer *buffer = NULL;
-  struct buffer *tmp;
-  uint32_t stride =
-      cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, background->width);
-
-  // Remove any unused buffers that are the wrong size
-  wl_list_for_each_safe(buffer, tmp, &background->buffers, link) {
-    if (!buffer->busy &&
-        (buffer->width != background->width ||
-         buffer->height != background->height || buffer->stride != stride)) {
-      wl_list_remove(&buffer->link);
-      free_buffer(buffer);
+static void search_index_build(void) {
+  search_index.folded = g_ptr_array_new_with_free_func(g_free);
+  search_index.grams = g_hash_table_new_full(
+      g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_array_unref);
+
+  for (guint row = 0; row < application_list->len; row++) {
+    struct app_entry *entry = application_list->pdata[row];
+    char *folded = fold_text(entry->name);
+    g_ptr_array_add(search_index.folded, folded);
+
+    size_t len = strlen(folded);
+    for (int n = 1; n <= 3; n++) {
+      for (size_t i = 0; i + n <= len; i++) {
+        gpointer key = GUINT_TO_POINTER(search_gram_key(folded + i, n));
+        GArray *rows = g_hash_table_lookup(search_index.grams, key);
+        if (!rows) {
+          rows = g_array_new(FALSE, FALSE, sizeof(guint));
+          g_hash_table_insert(search_index.grams, key, rows);
+        }
+        // Rows are added in order, so repeats within a name are adjacent
+        if (!rows->len || g_array_index(rows, guint, rows->len - 1) != row) {
+          g_array_append_val(rows, row);
+        }
+      }
     }
   }
+  search_index.valid = true;
+}
 
-  bool found = false;
-  wl_list_for_each_safe(buffer, tmp, &background->buffers, link) {
-    if (!buffer->busy && buffer->width == background->width &&
-        buffer->height == background->height && buffer->stride == stride) {
-      found = true;
-      break;
+// Returns the rows of application_list whose names contain the case folded
+// query. If previous is given it must be the result for a prefix of query
+static GArray *search_apps(char const *query, GArray *previous) {
+  if (!search_index.valid) {
+    search_index_build();
+  }
+
+  GArray *matches = g_array_new(FALSE, FALSE, sizeof(guint));
+  GArray *candidates = previous;
+  if (!candidates) {
+    size_t len = strlen(query);
+    int n = MIN(len, 3);
+    for (size_t i = 0; i + n <= len; i++) {
+      GArray *rows = g_hash_table_lookup(
+          search_index.grams, GUINT_TO_POINTER(search_gram_key(query + i, n)));
+      if (!rows) {
+        return matches;
+      }
+      if (!candidates || rows->len < candidates->len) {
+        candidates = rows;
+      }
     }
   }
 
-  if (!found) {
-    buffer = create_buffer(background->width, background->height, stride,
-                           WL_SHM_FORMAT_XRGB8888);
-    wl_list_insert(&background->buffers, &buffer->link);
+  for (guint i = 0; i < candidates->len; i++) {
+    guint row = g_array_index(candidates, guint, i);
+    if (strstr(search_index.folded->pdata[row], query)) {
+      g_array_append_val(matches, row);
+    }
   }
+  return matches;
+}
 
-  cairo_surface_t *surface = cairo_image_surface_create_for_data(
-      buffer->data, CAIRO_FORMAT_RGB24, background->width, background->height,
-      stride);
-  cairo_t *cr = cairo_create(surface);
+static void launcher_helper_forget(struct launch_record *record);
 
-  cairo_rectangle(cr, 0, 0, background->width, background->height);
-  cairo_set_source_rgb(cr, 0.5, 0.5, 0.5);
-  cairo_fill(cr);
+// Adds a finished launch to the histograms and the launch log
+static void finish_launch_record(struct launch_record *record) {
+#ifdef HAVE_TRACING
+  if (record->spawn) {
+    trace_async("launch spawn", record->name, record->click, record->click,
+                record->spawn);
+  }
+  if (record->exit) {
+    trace_async("launch exit", record->name, record->click, record->click,
+                record->exit);
+  }
+#endif
+  if (record->spawn) {
+    histogram_add(&spawn_latency, record_ms(record, record->spawn));
+  }
 
-  cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL,
-                         CAIRO_FONT_WEIGHT_NORMAL);
-  cairo_set_font_size(cr, 20);
+  if (config.launch_log) {
+    FILE *f = fopen(config.launch_log, "a");
+    if (f) {
+      // Columns are wall clock time, pid, then milliseconds from the click to
+      // the spawn and the exit, or - if they weren't seen
+      fprintf(f, "%" G_GINT64_FORMAT " %d", g_get_real_time() / 1000,
+              record->pid);
+      gint64 times[] = {record->spawn, record->exit};
+      for (size_t i = 0; i < G_N_ELEMENTS(times); i++) {
+        if (times[i]) {
+          fprintf(f, " %.1f", record_ms(record, times[i]));
+        } else {
+          fprintf(f, " -");
+        }
+      }
+      fprintf(f, " %s\n", record->name);
+      fclose(f);
+    } else {
+      perror("Unable to open launch log");
+    }
+  }
 
-  cairo_font_extents(cr, &background->extents);
+  if (record->timeout) {
+    g_source_remove(record->timeout);
+  }
+  if (record->token) {
+    xdg_activation_token_v1_destroy(record->token);
+  }
+  if (record->exit_watch) {
+    g_source_remove(record->exit_watch);
+  }
+  if (record->pidfd >= 0) {
+    close(record->pidfd);
+  }
+  launcher_helper_forget(record);
+  wl_list_remove(&record->link);
+  g_free(record->name);
+  g_object_unref(record->app);
+  free(record);
+}
 
-  double total_height =
-      g_list_length(application_list) * background->extents.height;
-  double max_y_scroll = total_height - (background->height - MENU_PADDING * 2);
-  if (max_y_scroll > 0) {
-    background->y_scroll = fmax(background->y_scroll, 0);
-    background->y_scroll = fmin(background->y_scroll, max_y_scroll);
-  } else {
-    background->y_scroll = 0;
+static gboolean launch_record_timeout(gpointer data) {
+  struct launch_record *record = data;
+  record->timeout = 0;
+  finish_launch_record(record);
+  return G_SOURCE_REMOVE;
+}
+
+// Writes out the launches that are still being timed, so that nothing is left
+// to wake the shell up once it is idle. Those still waiting for their token
+// are about to start and are left alone
+static void flush_launch_records(void) {
+  struct launch_record *record, *tmp;
+  wl_list_for_each_safe(record, tmp, &pending_launches, link) {
+    if (!record->token) {
+      finish_launch_record(record);
+    }
   }
+}
 
-  double y = MENU_PADDING - background->y_scroll;
-  for (GList *cur = application_list; cur != NULL; cur = cur->next) {
-    GAppInfo *app = cur->data;
-    if (y + background->extents.height >= 0 && y <= background->height) {
-      if (background->base.cursor_y > y &&
-          background->base.cursor_y <= y + background->extents.height) {
-        cairo_set_source_rgb(cr, 0, 1, 1);
-      } else {
-        cairo_set_source_rgb(cr, 0, 0, 0);
-      }
-      cairo_move_to(cr, MENU_PADDING, y + background->extents.ascent);
-      cairo_show_text(cr, g_app_info_get_name(app));
+static struct launch_record *start_launch_record(GAppInfo *app) {
+  struct launch_record *record = calloc(1, sizeof(*record));
+  record->name = g_strdup(g_app_info_get_name(app));
+  record->app = g_object_ref(app);
+  record->click = g_get_monotonic_time();
+  record->timeout = g_timeout_add_seconds(LAUNCH_PROFILE_TIMEOUT,
+                                          launch_record_timeout, record);
+  record->pidfd = -1;
+  wl_list_insert(&pending_launches, &record->link);
+  return record;
+}
+
+// The exit is the last thing recorded, so it finishes the record
+static void launched_child_exited(GPid pid, gint status, gpointer data) {
+  struct launch_record *record;
+  wl_list_for_each(record, &pending_launches, link) {
+    if (record->pid == pid) {
+      record->exit = g_get_monotonic_time();
+      finish_launch_record(record);
+      break;
     }
-    y += background->extents.height;
   }
+}
 
-  cairo_destroy(cr);
-  cairo_surface_destroy(surface);
+static gboolean launch_pidfd_ready(gint fd, GIOCondition condition,
+                                   gpointer data) {
+  struct launch_record *record = data;
+  record->exit_watch = 0;
+  record->exit = g_get_monotonic_time();
+  finish_launch_record(record);
+  return G_SOURCE_REMOVE;
+}
 
-  attach_buffer(background->surface, buffer, 0, 0);
-  wl_surface_damage(background->surface, 0, 0, background->width,
-                    background->height);
-  background->frame = wl_surface_frame(background->surface);
-  wl_callback_add_listener(background->frame, &background_frame_listener,
-                           background);
-  wl_surface_commit(background->surface);
+// Applications started by GIO, which spawns them through an intermediate
+// child, or by the launcher helper aren't children of the shell, so their
+// exit is watched through a pidfd instead. Without pidfd support, or if the
+// application already exited, no exit is recorded
+static void watch_launch_exit(struct launch_record *record) {
+  int fd = syscall(SYS_pidfd_open, record->pid, 0);
+  if (fd < 0) {
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  record->pidfd = fd;
+  record->exit_watch =
+      g_unix_fd_add(fd, G_IO_IN, launch_pidfd_ready, record);
 }
 
-static void background_configure(
-    void *data, struct weston_desktop_shell *weston_desktop_shell,
-    uint32_t edges, struct wl_surface *surface, int32_t width, int32_t height) {
-  struct background *background = data;
-  background->width = width;
-  background->height = height;
+// Usage
+//
+// How often and how recently each application was launched is kept in a key
+// file under the user data directory, with a group for each desktop file ID.
+// It is read at startup and written a few seconds after a launch, so that a
+// burst of launches is saved at once, without blocking the main loop.
+// Applications rank by their launch count, halved for every USAGE_HALF_LIFE
+// days since they were last launched. The menu-frequent highest are pinned
+// above the alphabetical list, and the launcher helper reads the executables
+// of the first few into the page cache whenever the shell goes idle
+#define USAGE_SAVE_DELAY (5)
+#define USAGE_HALF_LIFE (14.0)
+#define USAGE_PRELOAD_APPS (5)
+
+static GKeyFile *usage;
+static guint usage_save_source;
+// Entries of application_list pinned at the top of the menu, most used first
+static GPtrArray *frequent_apps;
 
-  draw_background(background);
+struct usage_rank {
+  struct app_entry *entry;
+  double score;
+};
+
+static char *usage_path(void) {
+  return g_build_filename(g_get_user_data_dir(), "weston-desktop-matchbox",
+                          "usage", NULL);
 }
 
-static void background_cursor_motion(void *data, struct seat *seat) {
-  struct background *background = data;
-  draw_background(background);
+static void load_usage(void) {
+  usage = g_key_file_new();
+  frequent_apps = g_ptr_array_new();
+
+  char *path = usage_path();
+  GError *error = NULL;
+  if (!g_key_file_load_from_file(usage, path, G_KEY_FILE_NONE, &error)) {
+    if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      fprintf(stderr, "Unable to load usage statistics '%s': %s\n", path,
+              error->message);
+    }
+    g_clear_error(&error);
+  }
+  g_free(path);
 }
 
-static void background_cursor_enter(void *data, struct seat *seat) {
-  struct background *background = data;
-  draw_background(background);
+static void usage_saved(GObject *source, GAsyncResult *result, gpointer data) {
+  GError *error = NULL;
+  if (!g_file_replace_contents_finish(G_FILE(source), result, NULL, &error)) {
+    fprintf(stderr, "Unable to save usage statistics: %s\n", error->message);
+    g_error_free(error);
+  }
+  g_free(data);
 }
 
-static void background_cursor_leave(void *data, struct seat *seat) {
-  struct background *background = data;
-  draw_background(background);
+static gboolean save_usage(gpointer data) {
+  usage_save_source = 0;
+  char *path = usage_path();
+  char *dir = g_path_get_dirname(path);
+  if (g_mkdir_with_parents(dir, 0700) < 0) {
+    fprintf(stderr, "Unable to create '%s': %s\n", dir, g_strerror(errno));
+  } else {
+    gsize len;
+    char *text = g_key_file_to_data(usage, &len, NULL);
+    GFile *file = g_file_new_for_path(path);
+    g_file_replace_contents_async(file, text, len, NULL, FALSE,
+                                  G_FILE_CREATE_PRIVATE, NULL, usage_saved,
+                                  text);
+    g_object_unref(file);
+  }
+  g_free(dir);
+  g_free(path);
+  return G_SOURCE_REMOVE;
 }
 
-static void background_pointer_axis(void *data, struct seat *seat,
-                                    uint32_t axis, double value) {
-  struct background *background = data;
-  if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
-    background->y_scroll += value;
-    draw_background(background);
+// Starts a save that is still waiting right away
+static void flush_usage(void) {
+  if (usage_save_source) {
+    g_source_remove(usage_save_source);
+    save_usage(NULL);
   }
 }
 
-static void background_pointer_button(void *data, struct seat *seat,
-                                      uint32_t button, uint32_t state) {
-  struct background *background = data;
-  if (button == BTN_LEFT && state == WL_POINTER_BUTTON_STATE_RELEASED &&
-      background->extents.height) {
-    double menu_y =
-        background->base.cursor_y + background->y_scroll - MENU_PADDING;
-    if (menu_y >= 0) {
-      guint menu_idx = menu_y / background->extents.height;
-      GAppInfo *app = g_list_nth_data(application_list, menu_idx);
-      if (app) {
-        launch_app(app);
-      }
+// Writes out a save that is still waiting, at exit
+static void finish_usage(void) {
+  if (usage_save_source) {
+    g_source_remove(usage_save_source);
+    usage_save_source = 0;
+
+    char *path = usage_path();
+    GError *error = NULL;
+    if (!g_key_file_save_to_file(usage, path, &error)) {
+      fprintf(stderr, "Unable to save usage statistics '%s': %s\n", path,
+              error->message);
+      g_error_free(error);
     }
+    g_free(path);
   }
+  g_ptr_array_free(frequent_apps, TRUE);
+  g_key_file_free(usage);
 }
 
-// Output
-static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
-                            int32_t y, int32_t physical_width,
+static double usage_score(char const *id, gint64 now) {
+  if (!id || !g_key_file_has_group(usage, id)) {
+    return 0;
+  }
+  gint64 launches = g_key_file_get_int64(usage, id, "launches", NULL);
+  gint64 last = g_key_file_get_int64(usage, id, "last-launch", NULL);
+  double days = MAX(now - last, 0) / (24.0 * 60 * 60);
+  return launches * exp2(-days / USAGE_HALF_LIFE);
+}
+
+// Ranks the highest score first, and equal scores in menu order
+static int compare_usage_rank(gconstpointer a, gconstpointer b) {
+  struct usage_rank const *rank_a = a;
+  struct usage_rank const *rank_b = b;
+
+  if (rank_a->score != rank_b->score) {
+    return rank_a->score < rank_b->score ? 1 : -1;
+  }
+  return strcmp(rank_a->entry->sort_key, rank_b->entry->sort_key);
+}
+
+// Returns up to n of the entries of application_list that have been launched,
+// most used first
+static GPtrArray *usage_top_apps(guint n) {
+  GPtrArray *top = g_ptr_array_new();
+  if (!n) {
+    return top;
+  }
+
+  gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+  GArray *ranks = g_array_new(FALSE, FALSE, sizeof(struct usage_rank));
+  for (guint i = 0; i < application_list->len; i++) {
+    struct usage_rank rank = {
+        .entry = application_list->pdata[i],
+        .score = usage_score(rank.entry->id, now),
+    };
+    if (rank.score > 0) {
+      g_array_append_val(ranks, rank);
+    }
+  }
+  g_array_sort(ranks, compare_usage_rank);
+
+  for (guint i = 0; i < ranks->len && i < n; i++) {
+    g_ptr_array_add(top, g_array_index(ranks, struct usage_rank, i).entry);
+  }
+  g_array_free(ranks, TRUE);
+  return top;
+}
+
+// Picks the applications pinned at the top of the menu again. This must be
+// done whenever application_list changes, since they point into it. Returns
+// true if they changed
+static bool update_frequent_apps(void) {
+  GPtrArray *top = usage_top_apps(config.menu_frequent);
+  bool changed = top->len != frequent_apps->len ||
+                 (top->len && memcmp(top->pdata, frequent_apps->pdata,
+                                     top->len * sizeof(gpointer)) != 0);
+  g_ptr_array_free(frequent_apps, TRUE);
+  frequent_apps = top;
+  return changed;
+}
+
+// Counts a launch of entry. Applications without a desktop file ID can't be
+// told apart across restarts, so they aren't counted
+static void usage_record(struct app_entry *entry) {
+  if (!entry->id) {
+    return;
+  }
+
+  gint64 launches = g_key_file_get_int64(usage, entry->id, "launches", NULL);
+  g_key_file_set_int64(usage, entry->id, "launches", launches + 1);
+  g_key_file_set_int64(usage, entry->id, "last-launch",
+                       g_get_real_time() / G_USEC_PER_SEC);
+  if (!usage_save_source) {
+    usage_save_source =
+        g_timeout_add_seconds(USAGE_SAVE_DELAY, save_usage, NULL);
+  }
+
+  if (update_frequent_apps()) {
+    struct output *output;
+    wl_list_for_each(output, &output_list, link) {
+      if (output->background) {
+        menu_reload(output->background->menu);
+      }
+    }
+  }
+}
+
+// Launching
+struct launch_command {
+  // Resolved path of the executable, or NULL if the application has to be
+  // launched through GIO
+  char *path;
+  char **argv;
+};
+
+// Commands that have been worked out for each GAppInfo
+static GHashTable *launch_commands;
+
+static void free_launch_command(gpointer data) {
+  struct launch_command *command = data;
+  g_free(command->path);
+  g_strfreev(command->argv);
+  free(command);
+}
+
+// Expands the field codes in an argument from an Exec key. Since the menu never
+// passes files or URLs, codes for them are removed
+static char *expand_field_codes(GDesktopAppInfo *info, char const *arg) {
+  GString *result = g_string_new(NULL);
+  for (char const *p = arg; *p; p++) {
+    if (*p != '%' || !p[1]) {
+      g_string_append_c(result, *p);
+      continue;
+    }
+
+    p++;
+    switch (*p) {
+    case '%':
+      g_string_append_c(result, '%');
+      break;
+    case 'c':
+      g_string_append(result, g_app_info_get_name(G_APP_INFO(info)));
+      break;
+    case 'k':
+      if (g_desktop_app_info_get_filename(info)) {
+        g_string_append(result, g_desktop_app_info_get_filename(info));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return g_string_free(result, FALSE);
+}
+
+// Works out the command line for an application from its Exec key so that it
+// can be spawned directly. Applications that need more than
+// that, like D-Bus activation, a terminal or a working directory, are left to
+// GIO
+static struct launch_command *build_launch_command(GAppInfo *app) {
+  struct launch_command *command = calloc(1, sizeof(*command));
+  if (!G_IS_DESKTOP_APP_INFO(app)) {
+    return command;
+  }
+
+  GDesktopAppInfo *info = G_DESKTOP_APP_INFO(app);
+  if (g_desktop_app_info_get_boolean(info, "Terminal") ||
+      g_desktop_app_info_get_boolean(info, "DBusActivatable") ||
+      g_desktop_app_info_has_key(info, "Path")) {
+    return command;
+  }
+
+  char *exec = g_desktop_app_info_get_string(info, "Exec");
+  char **args = NULL;
+  if (!exec || !g_shell_parse_argv(exec, NULL, &args, NULL)) {
+    g_free(exec);
+    return command;
+  }
+  g_free(exec);
+
+  GPtrArray *argv = g_ptr_array_new();
+  for (char **arg = args; *arg; arg++) {
+    if (strcmp(*arg, "%i") == 0) {
+      char *icon = g_desktop_app_info_get_string(info, "Icon");
+      if (icon) {
+        g_ptr_array_add(argv, g_strdup("--icon"));
+        g_ptr_array_add(argv, icon);
+      }
+    } else if ((*arg)[0] == '%' && (*arg)[1] && !(*arg)[2] &&
+               strchr("fFuUdDnNvm", (*arg)[1])) {
+      // A code that stands for files or URLs on its own is dropped entirely
+    } else {
+      g_ptr_array_add(argv, expand_field_codes(info, *arg));
+    }
+  }
+  g_strfreev(args);
+  g_ptr_array_add(argv, NULL);
+  command->argv = (char **)g_ptr_array_free(argv, FALSE);
+
+  // Resolve the executable once instead of searching PATH on every launch
+  if (command->argv[0]) {
+    command->path = g_find_program_in_path(command->argv[0]);
+  }
+  return command;
+}
+
+static void forget_launch_command(GAppInfo *app) {
+  if (launch_commands) {
+    g_hash_table_remove(launch_commands, app);
+  }
+}
+
+static void gio_app_launched(GAppLaunchContext *context, GAppInfo *app,
+                             GVariant *platform_data, gpointer data) {
+  struct launch_record *record = data;
+  gint32 pid;
+  if (g_variant_lookup(platform_data, "pid", "i", &pid)) {
+    record->pid = pid;
+    watch_launch_exit(record);
+  }
+}
+
+static void gio_launch_finished(GObject *source, GAsyncResult *result,
+                                gpointer data) {
+  struct launch_record *record = data;
+  GAppInfo *app = G_APP_INFO(source);
+  GError *error = NULL;
+
+  if (g_app_info_launch_uris_finish(app, result, &error)) {
+    record->spawn = g_get_monotonic_time();
+  } else {
+    fprintf(stderr, "Unable to launch '%s': %s\n", g_app_info_get_name(app),
+            error->message);
+    finish_launch_record(record);
+  }
+
+  g_clear_error(&error);
+}
+
+// GIO tells applications which desktop file they were started from and fills
+// in their own pid. The placeholder reserves room for the pid, which
+// spawn_command() writes in the child
+#define LAUNCH_PID_ENV "GIO_LAUNCHED_DESKTOP_FILE_PID"
+#define LAUNCH_PID_PLACEHOLDER "XXXXXXXXXXXXXXXXXXXX"
+
+// The environment app is started with, the same as GIO would give it, along
+// with the activation token for the launch if there is one.
+// libwayland removes WAYLAND_SOCKET when the shell connects, but it is dropped
+// here as well so that no application can ever be handed the shell's
+// connection
+static char **launch_environment(GAppInfo *app, char const *token) {
+  char **envp = g_environ_unsetenv(g_get_environ(), "WAYLAND_SOCKET");
+  if (token) {
+    envp = g_environ_setenv(envp, "XDG_ACTIVATION_TOKEN", token, TRUE);
+    envp = g_environ_setenv(envp, "DESKTOP_STARTUP_ID", token, TRUE);
+  }
+  char const *filename =
+      g_desktop_app_info_get_filename(G_DESKTOP_APP_INFO(app));
+  if (filename) {
+    envp = g_environ_setenv(envp, "GIO_LAUNCHED_DESKTOP_FILE", filename, TRUE);
+    envp = g_environ_setenv(envp, LAUNCH_PID_ENV, LAUNCH_PID_PLACEHOLDER, TRUE);
+  }
+  return envp;
+}
+
+// Writes pid over the placeholder. Runs in the child after vfork(), so it
+// can't call anything that isn't async-signal-safe
+static void fill_launch_pid(char *value, pid_t pid) {
+  char digits[sizeof(LAUNCH_PID_PLACEHOLDER)];
+  int n = 0;
+  do {
+    digits[n++] = '0' + pid % 10;
+    pid /= 10;
+  } while (pid);
+  for (int i = 0; i < n; i++) {
+    value[i] = digits[n - 1 - i];
+  }
+  value[n] = '\0';
+}
+
+// Starts command with vfork(), which is as cheap as posix_spawn() and also
+// lets the child fill in its pid in envp. The shell's signal handlers must
+// not run in the child while it shares the shell's memory, so every signal is
+// blocked until the child has reset them
+static bool spawn_command(struct launch_command *command, char **envp,
+                          pid_t *pid) {
+  char *pid_value = NULL;
+  for (char **env = envp; *env; env++) {
+    if (g_str_has_prefix(*env, LAUNCH_PID_ENV "=") &&
+        strlen(*env) == strlen(LAUNCH_PID_ENV "=" LAUNCH_PID_PLACEHOLDER)) {
+      pid_value = *env + strlen(LAUNCH_PID_ENV "=");
+    }
+  }
+
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  volatile int err = 0;
+  pid_t child = vfork();
+  if (child == 0) {
+    // Caught signals go back to their defaults, as does SIGCHLD, which the
+    // launcher helper ignores. Other ignored signals stay ignored, as they
+    // would with GIO
+    for (int sig = 1; sig < NSIG; sig++) {
+      struct sigaction action;
+      if (sigaction(sig, NULL, &action) == 0 &&
+          (sig == SIGCHLD || action.sa_handler != SIG_IGN) &&
+          action.sa_handler != SIG_DFL) {
+        action.sa_handler = SIG_DFL;
+        action.sa_flags = 0;
+        sigaction(sig, &action, NULL);
+      }
+    }
+
+    // Its own session like GIO gives it, and nothing the shell has blocked
+    setsid();
+    if (pid_value) {
+      fill_launch_pid(pid_value, getpid());
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    execve(command->path, command->argv, envp);
+    err = errno;
+    _exit(127);
+  }
+  if (child > 0 && err) {
+    waitpid(child, NULL, 0);
+  } else if (child < 0) {
+    err = errno;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (err) {
+    fprintf(stderr, "Unable to spawn '%s': %s\n", command->path,
+            strerror(err));
+    return false;
+  }
+  *pid = child;
+  return true;
+}
+
+static struct launch_command *get_launch_command(GAppInfo *app) {
+  if (!launch_commands) {
+    launch_commands = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                            free_launch_command);
+  }
+
+  struct launch_command *command = g_hash_table_lookup(launch_commands, app);
+  if (!command) {
+    command = build_launch_command(app);
+    g_hash_table_insert(launch_commands, app, command);
+  }
+  return command;
+}
+
+// Launcher helper
+//
+// A process forked before the shell starts any threads or maps any buffers.
+// Spawning from it is cheaper than from the shell, and it can read executables
+// into the page cache ahead of time without stalling the main loop. Requests
+// are sent as a single packet: a type byte followed by NUL terminated strings.
+// A launch is the path, the number of arguments, the arguments and then the
+// environment, which the shell builds so that the helper never passes on its
+// own
+#define LAUNCHER_MSG_MAX (16384)
+#define LAUNCHER_LAUNCH 'L'
+#define LAUNCHER_PRELOAD 'P'
+
+static int launcher_fd = -1;
+static guint launcher_watch;
+// Records waiting for the helper to reply with a pid, oldest first. Entries
+// are set to NULL if the record is finished before the reply arrives
+static GQueue launcher_pending = G_QUEUE_INIT;
+
+static void launcher_helper_launch_packet(char *msg, size_t len, int fd) {
+  size_t count = 0;
+  for (size_t i = 1; i < len; i++) {
+    count += msg[i] == '\0';
+  }
+
+  // NULL terminated, which also terminates the environment at the end
+  char **strings = calloc(count + 1, sizeof(char *));
+  char *p = msg + 1;
+  for (size_t i = 0; i < count; i++) {
+    strings[i] = p;
+    p += strlen(p) + 1;
+  }
+
+  gint32 reply = -1;
+  size_t argc = count >= 2 ? strtoul(strings[1], NULL, 10) : 0;
+  if (argc && argc <= count - 2) {
+    struct launch_command command = {
+        .path = strings[0],
+        .argv = calloc(argc + 1, sizeof(char *)),
+    };
+    memcpy(command.argv, strings + 2, argc * sizeof(char *));
+
+    pid_t pid;
+    if (spawn_command(&command, strings + 2 + argc, &pid)) {
+      reply = pid;
+    }
+    free(command.argv);
+  }
+  free(strings);
+
+  send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+static void launcher_helper_preload_packet(char const *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+
+  // Only starts the read, so a launch request arriving meanwhile isn't
+  // delayed
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+static void launcher_helper_run(int fd) {
+  // Nothing is interested in the exit status of the applications
+  signal(SIGCHLD, SIG_IGN);
+
+  char msg[LAUNCHER_MSG_MAX];
+  for (;;) {
+    ssize_t len = recv(fd, msg, sizeof(msg) - 1, 0);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      // The shell exited
+      break;
+    }
+
+    // Make sure the last string is terminated even if the packet wasn't
+    msg[len] = '\0';
+    if (msg[0] == LAUNCHER_LAUNCH) {
+      launcher_helper_launch_packet(msg, len, fd);
+    } else if (msg[0] == LAUNCHER_PRELOAD) {
+      launcher_helper_preload_packet(msg + 1);
+    }
+  }
+  _exit(0);
+}
+
+static void stop_launcher_helper(void) {
+  if (launcher_fd < 0) {
+    return;
+  }
+
+  if (launcher_watch) {
+    g_source_remove(launcher_watch);
+    launcher_watch = 0;
+  }
+  close(launcher_fd);
+  launcher_fd = -1;
+
+  // Launches that were in flight time out with no spawn time
+  g_queue_clear(&launcher_pending);
+}
+
+static gboolean launcher_helper_reply(gint fd, GIOCondition condition,
+                                      gpointer data) {
+  gint32 reply;
+  ssize_t len = recv(fd, &reply, sizeof(reply), MSG_DONTWAIT);
+  if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return G_SOURCE_CONTINUE;
+  }
+  if (len != sizeof(reply)) {
+    fprintf(stderr, "Launcher helper went away, launching directly\n");
+    launcher_watch = 0;
+    stop_launcher_helper();
+    return G_SOURCE_REMOVE;
+  }
+
+  struct launch_record *record = g_queue_pop_head(&launcher_pending);
+  if (!record) {
+    return G_SOURCE_CONTINUE;
+  }
+
+  if (reply > 0) {
+    record->pid = reply;
+    record->spawn = g_get_monotonic_time();
+    watch_launch_exit(record);
+  } else {
+    finish_launch_record(record);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static void launcher_helper_exited(GPid pid, gint status, gpointer data) {
+  stop_launcher_helper();
+}
+
+// Forks the helper. This must happen before any threads are started
+static void start_launcher_helper(void) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    perror("Unable to create launcher helper socket");
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("Unable to fork launcher helper");
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+
+    // The display isn't connected yet, so the socket weston started the shell
+    // with is still open and not close-on-exec. Nothing the helper starts may
+    // get hold of it
+    char const *socket = getenv("WAYLAND_SOCKET");
+    if (socket) {
+      char *end;
+      long wayland_fd = strtol(socket, &end, 10);
+      if (!*end && wayland_fd >= 0 && wayland_fd != fds[1]) {
+        close(wayland_fd);
+      }
+      unsetenv("WAYLAND_SOCKET");
+    }
+    launcher_helper_run(fds[1]);
+  }
+
+  close(fds[1]);
+  launcher_fd = fds[0];
+  launcher_watch = g_unix_fd_add(launcher_fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                 launcher_helper_reply, NULL);
+  g_child_watch_add(pid, launcher_helper_exited, NULL);
+}
+
+// Appends a NUL terminated string to a request, returning false if it doesn't
+// fit
+static bool launcher_msg_append(char *msg, size_t *len, char const *str) {
+  size_t size = strlen(str) + 1;
+  if (*len + size > LAUNCHER_MSG_MAX) {
+    return false;
+  }
+  memcpy(msg + *len, str, size);
+  *len += size;
+  return true;
+}
+
+static bool launcher_send(char const *msg, size_t len) {
+  if (send(launcher_fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    if (errno != EAGAIN) {
+      perror("Unable to send to launcher helper");
+      stop_launcher_helper();
+    }
+    return false;
+  }
+  return true;
+}
+
+// Asks the helper to spawn command with the environment envp. Returns false
+// if the launch has to be done some other way
+static bool launcher_helper_launch(struct launch_command *command,
+                                   char **envp, struct launch_record *record) {
+  if (launcher_fd < 0) {
+    return false;
+  }
+
+  char msg[LAUNCHER_MSG_MAX];
+  size_t len = 1;
+  msg[0] = LAUNCHER_LAUNCH;
+  char argc[16];
+  g_snprintf(argc, sizeof(argc), "%u", g_strv_length(command->argv));
+  if (!launcher_msg_append(msg, &len, command->path) ||
+      !launcher_msg_append(msg, &len, argc)) {
+    return false;
+  }
+  for (char **arg = command->argv; *arg; arg++) {
+    if (!launcher_msg_append(msg, &len, *arg)) {
+      return false;
+    }
+  }
+  for (char **env = envp; *env; env++) {
+    if (!launcher_msg_append(msg, &len, *env)) {
+      return false;
+    }
+  }
+
+  if (!launcher_send(msg, len)) {
+    return false;
+  }
+  g_queue_push_tail(&launcher_pending, record);
+  return true;
+}
+
+static void launcher_helper_forget(struct launch_record *record) {
+  GList *link = g_queue_find(&launcher_pending, record);
+  if (link) {
+    link->data = NULL;
+  }
+}
+
+static void launcher_helper_preload_app(struct app_entry *entry) {
+  if (!entry->info) {
+    return;
+  }
+  struct launch_command *command = get_launch_command(entry->info);
+  if (!command->path) {
+    return;
+  }
+
+  char msg[LAUNCHER_MSG_MAX];
+  size_t len = 1;
+  msg[0] = LAUNCHER_PRELOAD;
+  if (launcher_msg_append(msg, &len, command->path)) {
+    launcher_send(msg, len);
+  }
+}
+
+// Has the helper read the executables of the configured applications into the
+// page cache so their first launch doesn't wait on storage
+static void launcher_helper_preload(void) {
+  if (launcher_fd < 0 || !config.launcher_preload) {
+    return;
+  }
+
+  for (guint i = 0; i < application_list->len; i++) {
+    struct app_entry *entry = application_list->pdata[i];
+    if (g_strv_contains((char const *const *)config.launcher_preload,
+                        entry->id)) {
+      launcher_helper_preload_app(entry);
+    }
+  }
+}
+
+// Does the same for the most used applications, which the system may have
+// evicted from the page cache since they were last launched
+static void launcher_helper_preload_frequent(void) {
+  if (launcher_fd < 0) {
+    return;
+  }
+
+  GPtrArray *top = usage_top_apps(USAGE_PRELOAD_APPS);
+  for (guint i = 0; i < top->len; i++) {
+    launcher_helper_preload_app(top->pdata[i]);
+  }
+  g_ptr_array_free(top, TRUE);
+}
+
+static void start_launch(struct launch_record *record, char const *token) {
+  GAppInfo *app = record->app;
+  struct launch_command *command = get_launch_command(app);
+
+  if (command->path) {
+    char **envp = launch_environment(app, token);
+    pid_t pid;
+    bool launched = launcher_helper_launch(command, envp, record);
+    if (!launched && spawn_command(command, envp, &pid)) {
+      record->pid = pid;
+      record->spawn = g_get_monotonic_time();
+      g_child_watch_add(pid, launched_child_exited, NULL);
+      launched = true;
+    }
+    g_strfreev(envp);
+    if (launched) {
+      return;
+    }
+  }
+
+  // Spawning directly isn't suitable for this application. Let GIO handle it
+  // without blocking the main loop
+  GAppLaunchContext *context = g_app_launch_context_new();
+  if (token) {
+    g_app_launch_context_setenv(context, "XDG_ACTIVATION_TOKEN", token);
+    g_app_launch_context_setenv(context, "DESKTOP_STARTUP_ID", token);
+  }
+  g_signal_connect(context, "launched", G_CALLBACK(gio_app_launched), record);
+  g_app_info_launch_uris_async(app, NULL, context, NULL, gio_launch_finished,
+                               record);
+  g_object_unref(context);
+}
+
+static void launch_token_done(void *data,
+                              struct xdg_activation_token_v1 *token,
+                              char const *token_string) {
+  struct launch_record *record = data;
+  xdg_activation_token_v1_destroy(record->token);
+  record->token = NULL;
+  start_launch(record, token_string);
+}
+
+static const struct xdg_activation_token_v1_listener launch_token_listener = {
+    launch_token_done,
+};
+
+// Launches an application the user picked with an input event on seat
+static void launch_app(struct app_entry *entry, struct seat *seat) {
+  GAppInfo *app = app_entry_info(entry);
+  if (!app) {
+    fprintf(stderr, "Unable to find application '%s'\n", entry->name);
+    return;
+  }
+  usage_record(entry);
+
+  struct launch_record *record = start_launch_record(app);
+  if (!xdg_activation) {
+    start_launch(record, NULL);
+    return;
+  }
+
+  // The token lets the compositor focus the application's window when it
+  // appears. Launching waits the roundtrip it takes to get one
+  record->token = xdg_activation_v1_get_activation_token(xdg_activation);
+  xdg_activation_token_v1_add_listener(record->token, &launch_token_listener,
+                                       record);
+  xdg_activation_token_v1_set_serial(record->token, seat->serial, seat->seat);
+  char const *id = g_app_info_get_id(app);
+  if (id) {
+    char *app_id = g_strdup(id);
+    if (g_str_has_suffix(app_id, ".desktop")) {
+      app_id[strlen(app_id) - strlen(".desktop")] = '\0';
+    }
+    xdg_activation_token_v1_set_app_id(record->token, app_id);
+    g_free(app_id);
+  }
+  xdg_activation_token_v1_commit(record->token);
+}
+
+// SHM pool
+static void init_shm_pool(struct shm_pool *pool) {
+  pool->fd = -1;
+  wl_list_init(&pool->free_ranges);
+  wl_list_init(&pool->buffers);
+}
+
+static void free_buffer(struct buffer *buffer);
+
+// Frees every buffer still in the pool and the pool itself. The surfaces the
+// buffers were attached to must already be destroyed
+static void finish_shm_pool(struct shm_pool *pool) {
+  struct buffer *buffer, *tmp;
+  wl_list_for_each_safe(buffer, tmp, &pool->buffers, link) {
+    free_buffer(buffer);
+  }
+
+  struct pool_range *range, *next;
+  wl_list_for_each_safe(range, next, &pool->free_ranges, link) {
+    wl_list_remove(&range->link);
+    free(range);
+  }
+
+  if (pool->pool) {
+    wl_shm_pool_destroy(pool->pool);
+  }
+  if (pool->data) {
+    munmap(pool->data, pool->size);
+  }
+  if (pool->fd >= 0) {
+    close(pool->fd);
+  }
+  init_shm_pool(pool);
+  pool->pool = NULL;
+  pool->data = NULL;
+  pool->size = 0;
+}
+
+// A wl_shm_pool can't shrink, so the pages of free ranges are given back to
+// the system instead. Those that are reused are faulted back in as zeros
+static void shm_pool_discard(struct shm_pool *pool, size_t offset,
+                             size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t start = (offset + page - 1) / page * page;
+  size_t end = (offset + size) / page * page;
+  if (end > start &&
+      fallocate(pool->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+                end - start)) {
+    perror("Unable to discard pool pages");
+  }
+}
+
+// Adds a range back to the free list, merging it with any neighbours
+static void shm_pool_free_range(struct shm_pool *pool, size_t offset,
+                                size_t size) {
+  struct pool_range *range;
+  struct pool_range *next = NULL;
+  wl_list_for_each(range, &pool->free_ranges, link) {
+    if (range->offset > offset) {
+      next = range;
+      break;
+    }
+  }
+
+  struct wl_list *prev_link = next ? next->link.prev : pool->free_ranges.prev;
+  struct pool_range *prev = NULL;
+  if (prev_link != &pool->free_ranges) {
+    prev = wl_container_of(prev_link, prev, link);
+  }
+
+  if (prev && prev->offset + prev->size == offset) {
+    prev->size += size;
+    if (next && prev->offset + prev->size == next->offset) {
+      prev->size += next->size;
+      wl_list_remove(&next->link);
+      free(next);
+    }
+  } else if (next && offset + size == next->offset) {
+    next->offset = offset;
+    next->size += size;
+  } else {
+    range = calloc(1, sizeof(*range));
+    range->offset = offset;
+    range->size = size;
+    wl_list_insert(prev_link, &range->link);
+  }
+}
+
+// Discards the ranges that are still free. Buffers freed while drawing, such
+// as on a resize, are usually allocated again straight away, so their pages
+// are kept until the shell goes idle
+static void shm_pool_trim(struct shm_pool *pool) {
+  struct pool_range *range;
+  wl_list_for_each(range, &pool->free_ranges, link) {
+    shm_pool_discard(pool, range->offset, range->size);
+  }
+}
+
+// Grows the pool so that at least size bytes are free at the end of it
+static bool shm_pool_grow(struct shm_pool *pool, size_t size) {
+  size_t trailing = 0;
+  if (!wl_list_empty(&pool->free_ranges)) {
+    struct pool_range *last =
+        wl_container_of(pool->free_ranges.prev, last, link);
+    if (last->offset + last->size == pool->size) {
+      trailing = last->size;
+    }
+  }
+
+  size_t old_size = pool->size;
+  size_t new_size = old_size + size - trailing;
+  if (new_size > INT32_MAX) {
+    fprintf(stderr, "SHM pool size %zu is too large\n", new_size);
+    return false;
+  }
+
+  if (pool->fd < 0) {
+    pool->fd = memfd_create("buffer-pool", MFD_CLOEXEC);
+    if (pool->fd < 0) {
+      perror("Unable to create memfd");
+      return false;
+    }
+  }
+
+  if (ftruncate(pool->fd, new_size)) {
+    perror("Unable to truncate memfd");
+    return false;
+  }
+
+  void *data;
+  if (pool->data) {
+    data = mremap(pool->data, old_size, new_size, MREMAP_MAYMOVE);
+  } else {
+    data = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd,
+                0);
+  }
+  if (data == MAP_FAILED) {
+    perror("Unable to map memfd");
+    return false;
+  }
+  pool->data = data;
+  pool->size = new_size;
+
+  if (pool->pool) {
+    wl_shm_pool_resize(pool->pool, new_size);
+  } else {
+    pool->pool = wl_shm_create_pool(shm, pool->fd, new_size);
+  }
+
+  shm_pool_free_range(pool, old_size, new_size - old_size);
+  return true;
+}
+
+// Reserves size bytes from the pool and returns their offset, or -1 on failure
+static ssize_t shm_pool_alloc(struct shm_pool *pool, size_t size) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    struct pool_range *range;
+    wl_list_for_each(range, &pool->free_ranges, link) {
+      if (range->size >= size) {
+        size_t offset = range->offset;
+        range->offset += size;
+        range->size -= size;
+        if (!range->size) {
+          wl_list_remove(&range->link);
+          free(range);
+        }
+        return offset;
+      }
+    }
+
+    if (!shm_pool_grow(pool, size)) {
+      break;
+    }
+  }
+  return -1;
+}
+
+// Buffer
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+  struct buffer *buffer = data;
+  buffer->busy = false;
+
+  struct swapchain *swapchain = buffer->swapchain;
+  if (!swapchain) {
+    free_buffer(buffer);
+  } else if (swapchain->stalled) {
+    swapchain->stalled = false;
+    swapchain->on_release(swapchain->data);
+  }
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    buffer_release,
+};
+
+static struct buffer *create_buffer(struct shm_pool *pool, uint32_t width,
+                                    uint32_t height, uint32_t stride,
+                                    uint32_t format) {
+  size_t size = height * stride;
+  ssize_t offset = shm_pool_alloc(pool, size);
+  if (offset < 0) {
+    return NULL;
+  }
+
+  struct buffer *buffer = calloc(1, sizeof(*buffer));
+
+  buffer->buffer = wl_shm_pool_create_buffer(pool->pool, offset, width, height,
+                                             stride, format);
+  wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+
+  buffer->pool = pool;
+  wl_list_insert(&pool->buffers, &buffer->link);
+  buffer->offset = offset;
+  buffer->width = width;
+  buffer->height = height;
+  buffer->stride = stride;
+  buffer->format = format;
+  buffer->size = size;
+
+  cairo_rectangle_int_t rect = {0, 0, width, height};
+  buffer->damage = cairo_region_create_rectangle(&rect);
+
+  return buffer;
+}
+
+static void free_buffer(struct buffer *buffer) {
+  cairo_region_destroy(buffer->damage);
+  shm_pool_free_range(buffer->pool, buffer->offset, buffer->size);
+  wl_list_remove(&buffer->link);
+  wl_buffer_destroy(buffer->buffer);
+  free(buffer);
+}
+
+// The pool may be remapped when it grows, so the address of the buffer contents
+// must be looked up each time they are accessed
+static void *buffer_data(struct buffer *buffer) {
+  return (uint8_t *)buffer->pool->data + buffer->offset;
+}
+
+static void attach_buffer(struct wl_surface *surface, struct buffer *buffer,
+                          int32_t x, int32_t y) {
+  wl_surface_attach(surface, buffer->buffer, x, y);
+  buffer->busy = true;
+}
+
+// Copies the contents of region from src to dst. Both buffers must be the same
+// size and format
+static void copy_buffer_region(struct buffer *dst, struct buffer *src,
+                               cairo_region_t *region) {
+  int n = cairo_region_num_rectangles(region);
+  for (int i = 0; i < n; i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(region, i, &rect);
+
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+      size_t offset = y * dst->stride + rect.x * 4;
+      memcpy((uint8_t *)buffer_data(dst) + offset,
+             (uint8_t *)buffer_data(src) + offset, rect.width * 4);
+    }
+  }
+}
+
+// Swapchain
+static void init_swapchain(struct swapchain *swapchain, struct shm_pool *pool,
+                           uint32_t format, void (*on_release)(void *),
+                           void *data) {
+  swapchain->pool = pool;
+  swapchain->format = format;
+  swapchain->on_release = on_release;
+  swapchain->data = data;
+}
+
+static void swapchain_print_stats(struct swapchain *swapchain,
+                                  char const *name) {
+  fprintf(stderr, "%s swapchain: %u allocations, %u reuses, %u stalls\n",
+          name, swapchain->stats.allocations, swapchain->stats.reuses,
+          swapchain->stats.stalls);
+}
+
+// Changes the size of the buffers in the swapchain. Existing buffers are
+// dropped, or freed once the compositor releases them if they are busy
+static void swapchain_resize(struct swapchain *swapchain, uint32_t width,
+                             uint32_t height, uint32_t stride) {
+  if (swapchain->width == width && swapchain->height == height &&
+      swapchain->stride == stride) {
+    return;
+  }
+
+  for (int i = 0; i < SWAPCHAIN_MAX_BUFFERS; i++) {
+    struct buffer *buffer = swapchain->buffers[i];
+    if (!buffer) {
+      continue;
+    }
+
+    if (buffer->busy) {
+      buffer->swapchain = NULL;
+    } else {
+      free_buffer(buffer);
+    }
+    swapchain->buffers[i] = NULL;
+  }
+
+  swapchain->front = NULL;
+  swapchain->width = width;
+  swapchain->height = height;
+  swapchain->stride = stride;
+}
+
+// Drops every buffer. Busy ones are freed when the compositor releases them,
+// or with the pool
+static void finish_swapchain(struct swapchain *swapchain) {
+  swapchain_resize(swapchain, 0, 0, 0);
+}
+
+// Frees the buffers that are neither on screen nor held by the compositor.
+// They are allocated again if drawing needs more than the front buffer
+static void swapchain_trim(struct swapchain *swapchain) {
+  for (int i = 0; i < SWAPCHAIN_MAX_BUFFERS; i++) {
+    struct buffer *buffer = swapchain->buffers[i];
+    if (buffer && buffer != swapchain->front && !buffer->busy) {
+      free_buffer(buffer);
+      swapchain->buffers[i] = NULL;
+    }
+  }
+}
+
+// Returns a buffer to draw the next frame into, with everything outside of
+// damage already matching the last frame. Returns NULL if every buffer is busy,
+// in which case on_release is called when one becomes available
+static struct buffer *swapchain_acquire(struct swapchain *swapchain,
+                                        cairo_region_t *damage) {
+  struct buffer *buffer = NULL;
+  int empty_slot = -1;
+
+  // Prefer the front buffer since it is already up to date
+  if (swapchain->front && !swapchain->front->busy) {
+    buffer = swapchain->front;
+  }
+
+  for (int i = 0; i < SWAPCHAIN_MAX_BUFFERS && !buffer; i++) {
+    if (!swapchain->buffers[i]) {
+      if (empty_slot < 0) {
+        empty_slot = i;
+      }
+    } else if (!swapchain->buffers[i]->busy) {
+      buffer = swapchain->buffers[i];
+    }
+  }
+
+  if (buffer) {
+    swapchain->stats.reuses++;
+  } else if (empty_slot >= 0) {
+    buffer = create_buffer(swapchain->pool, swapchain->width,
+                           swapchain->height, swapchain->stride,
+                           swapchain->format);
+    if (!buffer) {
+      return NULL;
+    }
+    buffer->swapchain = swapchain;
+    swapchain->buffers[empty_slot] = buffer;
+    swapchain->stats.allocations++;
+  } else {
+    swapchain->stats.stalls++;
+    swapchain->stalled = true;
+    return NULL;
+  }
+
+  struct buffer *front = swapchain->front;
+  if (front && front != buffer) {
+    cairo_region_t *stale = cairo_region_copy(buffer->damage);
+    cairo_region_subtract(stale, damage);
+    copy_buffer_region(buffer, front, stale);
+    cairo_region_destroy(stale);
+  }
+
+  return buffer;
+}
+
+// Attaches a buffer that was drawn within damage to surface
+static void swapchain_present(struct swapchain *swapchain,
+                              struct buffer *buffer, struct wl_surface *surface,
+                              cairo_region_t *damage) {
+  // Every other buffer is now out of date wherever this frame changed
+  for (int i = 0; i < SWAPCHAIN_MAX_BUFFERS; i++) {
+    struct buffer *other = swapchain->buffers[i];
+    if (other && other != buffer) {
+      cairo_region_union(other->damage, damage);
+    }
+  }
+  cairo_region_destroy(buffer->damage);
+  buffer->damage = cairo_region_create();
+
+  attach_buffer(surface, buffer, 0, 0);
+  int num_rects = cairo_region_num_rectangles(damage);
+  for (int i = 0; i < num_rects; i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(damage, i, &rect);
+    wl_surface_damage_buffer(surface, rect.x, rect.y, rect.width, rect.height);
+  }
+
+  swapchain->front = buffer;
+}
+
+#ifdef HAVE_EGL
+// EGL
+//
+// With EGL the menu is drawn with OpenGL ES into buffers the compositor can
+// use without a copy. The rows are still rasterized once by cairo and kept as
+// textures, so a frame is a clear and a textured quad per visible row. The
+// background stays on wl_shm since it is a single pixel or a cached image that
+// never changes. Without a usable EGL display the shell falls back to wl_shm
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLConfig egl_config;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+static GLuint gl_program;
+static GLint gl_size_uniform;
+static GLint gl_color_uniform;
+// Key of the texture made from a row mask, deleted along with the mask
+static cairo_user_data_key_t gl_texture_key;
+// Textures of masks that were freed, deleted the next time the context is
+// current. Masks are freed where it may not be, such as when the row caches
+// are emptied or a menu is destroyed
+static GArray *gl_dead_textures;
+
+static char const gl_vertex_shader[] =
+    "uniform vec2 size;\n"
+    "attribute vec2 position;\n"
+    "attribute vec2 texcoord;\n"
+    "varying vec2 v_texcoord;\n"
+    "void main() {\n"
+    "  gl_Position = vec4(position.x / size.x * 2.0 - 1.0,\n"
+    "                     1.0 - position.y / size.y * 2.0, 0.0, 1.0);\n"
+    "  v_texcoord = texcoord;\n"
+    "}\n";
+
+static char const gl_fragment_shader[] =
+    "precision mediump float;\n"
+    "uniform sampler2D tex;\n"
+    "uniform vec3 color;\n"
+    "varying vec2 v_texcoord;\n"
+    "void main() {\n"
+    "  gl_FragColor = vec4(color, texture2D(tex, v_texcoord).a);\n"
+    "}\n";
+
+static void init_egl(void) {
+  static EGLint const config_attribs[] = {
+      EGL_SURFACE_TYPE,
+      EGL_WINDOW_BIT,
+      EGL_RED_SIZE,
+      8,
+      EGL_GREEN_SIZE,
+      8,
+      EGL_BLUE_SIZE,
+      8,
+      EGL_ALPHA_SIZE,
+      0,
+      EGL_RENDERABLE_TYPE,
+      EGL_OPENGL_ES2_BIT,
+      EGL_NONE,
+  };
+  static EGLint const context_attribs[] = {
+      EGL_CONTEXT_CLIENT_VERSION,
+      2,
+      EGL_NONE,
+  };
+
+  egl_display = eglGetDisplay((EGLNativeDisplayType)display);
+  if (egl_display == EGL_NO_DISPLAY ||
+      !eglInitialize(egl_display, NULL, NULL)) {
+    fprintf(stderr, "Unable to initialize EGL, using wl_shm\n");
+    egl_display = EGL_NO_DISPLAY;
+    return;
+  }
+
+  EGLint num_configs = 0;
+  if (!eglBindAPI(EGL_OPENGL_ES_API) ||
+      !eglChooseConfig(egl_display, config_attribs, &egl_config, 1,
+                       &num_configs) ||
+      num_configs < 1) {
+    fprintf(stderr, "No suitable EGL config, using wl_shm\n");
+    eglTerminate(egl_display);
+    egl_display = EGL_NO_DISPLAY;
+    return;
+  }
+
+  egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT,
+                                 context_attribs);
+  if (egl_context == EGL_NO_CONTEXT) {
+    fprintf(stderr, "Unable to create EGL context (0x%x), using wl_shm\n",
+            eglGetError());
+    eglTerminate(egl_display);
+    egl_display = EGL_NO_DISPLAY;
+  }
+}
+
+static void finish_egl(void) {
+  if (egl_display == EGL_NO_DISPLAY) {
+    return;
+  }
+  eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  // Destroying the context deletes its textures
+  eglDestroyContext(egl_display, egl_context);
+  eglTerminate(egl_display);
+  egl_display = EGL_NO_DISPLAY;
+  egl_context = EGL_NO_CONTEXT;
+  g_clear_pointer(&gl_dead_textures, g_array_unref);
+}
+
+static GLuint compile_shader(GLenum type, char const *source) {
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+
+  GLint status;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    char log[1000];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Unable to compile shader: %s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+// Builds the program rows are drawn with. Needs the context to be current
+static bool init_gl_program(void) {
+  GLuint vertex = compile_shader(GL_VERTEX_SHADER, gl_vertex_shader);
+  GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, gl_fragment_shader);
+  if (!vertex || !fragment) {
+    return false;
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vertex);
+  glAttachShader(program, fragment);
+  glBindAttribLocation(program, 0, "position");
+  glBindAttribLocation(program, 1, "texcoord");
+  glLinkProgram(program);
+  glDeleteShader(vertex);
+  glDeleteShader(fragment);
+
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status) {
+    char log[1000];
+    glGetProgramInfoLog(program, sizeof(log), NULL, log);
+    fprintf(stderr, "Unable to link program: %s\n", log);
+    glDeleteProgram(program);
+    return false;
+  }
+
+  gl_program = program;
+  gl_size_uniform = glGetUniformLocation(program, "size");
+  gl_color_uniform = glGetUniformLocation(program, "color");
+  return true;
+}
+
+static void delete_texture(void *data) {
+  if (egl_context == EGL_NO_CONTEXT) {
+    // Went with the context
+    return;
+  }
+  GLuint texture = GPOINTER_TO_UINT(data);
+  if (!gl_dead_textures) {
+    gl_dead_textures = g_array_new(FALSE, FALSE, sizeof(GLuint));
+  }
+  g_array_append_val(gl_dead_textures, texture);
+}
+
+// Needs the context to be current
+static void delete_dead_textures(void) {
+  if (gl_dead_textures && gl_dead_textures->len) {
+    glDeleteTextures(gl_dead_textures->len,
+                     (GLuint const *)gl_dead_textures->data);
+    g_array_set_size(gl_dead_textures, 0);
+  }
+}
+
+// Returns the texture for a row mask, uploading it the first time. The rows
+// of an A8 image are padded to 4 bytes, so the texture is stride pixels wide
+static GLuint mask_texture(cairo_surface_t *mask) {
+  GLuint texture =
+      GPOINTER_TO_UINT(cairo_surface_get_user_data(mask, &gl_texture_key));
+  if (texture) {
+    return texture;
+  }
+
+  cairo_surface_flush(mask);
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, cairo_image_surface_get_stride(mask),
+               cairo_image_surface_get_height(mask), 0, GL_ALPHA,
+               GL_UNSIGNED_BYTE, cairo_image_surface_get_data(mask));
+  cairo_surface_set_user_data(mask, &gl_texture_key, GUINT_TO_POINTER(texture),
+                              delete_texture);
+  return texture;
+}
+#endif
+
+// Row cache
+//
+// Caches are shared by every menu drawn at the same scale, so that outputs
+// with the same scale only render each row once
+static struct wl_list row_caches = {&row_caches, &row_caches};
+
+static void set_menu_font(cairo_t *cr, double scale) {
+  cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size(cr, MENU_FONT_SIZE * scale);
+}
+
+// Returns a reference to the cache for a scale in 120ths
+static struct row_cache *row_cache_ref(uint32_t scale_120) {
+  struct row_cache *cache;
+  wl_list_for_each(cache, &row_caches, link) {
+    if (cache->scale_120 == scale_120) {
+      cache->refcount++;
+      return cache;
+    }
+  }
+
+  cache = calloc(1, sizeof(*cache));
+  cache->refcount = 1;
+  cache->scale_120 = scale_120;
+  cache->scale = scale_120 / 120.0;
+  cache->padding = round(MENU_PADDING * cache->scale);
+  cache->rows = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      (GDestroyNotify)cairo_surface_destroy);
+
+  // Text is only measured on this context, it is never drawn to
+  cache->layout_surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+  cache->layout = cairo_create(cache->layout_surface);
+  set_menu_font(cache->layout, cache->scale);
+  cairo_font_extents(cache->layout, &cache->extents);
+
+  wl_list_insert(&row_caches, &cache->link);
+  return cache;
+}
+
+static void row_cache_unref(struct row_cache *cache) {
+  if (--cache->refcount) {
+    return;
+  }
+  wl_list_remove(&cache->link);
+  g_hash_table_destroy(cache->rows);
+  cairo_destroy(cache->layout);
+  cairo_surface_destroy(cache->layout_surface);
+  free(cache);
+}
+
+// Drops the cached mask for text, if there is one
+static void row_cache_remove(struct row_cache *cache, char const *text) {
+  g_hash_table_remove(cache->rows, text);
+}
+
+// Returns the width of the mask for a menu row showing text, measured on
+// layout, which has the font of the cache set. A cairo context can only be
+// used by one thread at a time, so the render workers bring their own
+static int row_width(struct row_cache *cache, cairo_t *layout,
+                     char const *text) {
+  cairo_text_extents_t text_extents;
+  cairo_text_extents(layout, text, &text_extents);
+  return cache->padding * 2 + ceil(text_extents.x_advance);
+}
+
+// Returns the width of the mask for a menu row showing text, without rendering
+// it
+static int row_cache_measure(struct row_cache *cache, char const *text) {
+  return row_width(cache, cache->layout, text);
+}
+
+// Renders the mask for a menu row showing text, without caching it
+static cairo_surface_t *render_row(struct row_cache *cache, cairo_t *layout,
+                                   char const *text) {
+  cairo_surface_t *mask = cairo_image_surface_create(
+      CAIRO_FORMAT_A8, row_width(cache, layout, text),
+      ceil(cache->extents.height));
+  cairo_t *cr = cairo_create(mask);
+  set_menu_font(cr, cache->scale);
+  cairo_move_to(cr, cache->padding, cache->extents.ascent);
+  cairo_show_text(cr, text);
+  cairo_destroy(cr);
+  return mask;
+}
+
+// Returns the mask for a menu row showing text, rendering it the first time it
+// is requested
+static cairo_surface_t *row_cache_get(struct row_cache *cache,
+                                      char const *text) {
+  cairo_surface_t *mask = g_hash_table_lookup(cache->rows, text);
+  if (!mask) {
+    mask = render_row(cache, cache->layout, text);
+    g_hash_table_insert(cache->rows, g_strdup(text), mask);
+  }
+  return mask;
+}
+
+// Cursor
+//
+// Themes are loaded the first time a pointer enters a surface on an output
+// with a new scale, and the cursors are looked up by name once per theme.
+// libwayland-cursor creates the wl_buffer of each image once and keeps it
+struct cursor_theme {
+  struct wl_list link;
+  int32_t scale;
+  // NULL if it failed to load
+  struct wl_cursor_theme *theme;
+  // Name to struct wl_cursor, or NULL for names that aren't in the theme
+  GHashTable *cursors;
+};
+
+static struct wl_list cursor_themes = {&cursor_themes, &cursor_themes};
+
+static struct wl_cursor *get_cursor(char const *name, int32_t scale) {
+  struct cursor_theme *theme;
+  bool found = false;
+  wl_list_for_each(theme, &cursor_themes, link) {
+    if (theme->scale == scale) {
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    theme = calloc(1, sizeof(*theme));
+    theme->scale = scale;
+    theme->theme = wl_cursor_theme_load(config.cursor_theme,
+                                        config.cursor_size * scale, shm);
+    if (!theme->theme) {
+      fprintf(stderr, "Unable to load cursor theme '%s' at size %d\n",
+              config.cursor_theme ? config.cursor_theme : "default",
+              config.cursor_size * scale);
+    }
+    theme->cursors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           NULL);
+    wl_list_insert(&cursor_themes, &theme->link);
+  }
+
+  gpointer cursor;
+  if (!g_hash_table_lookup_extended(theme->cursors, name, NULL, &cursor)) {
+    cursor = theme->theme ? wl_cursor_theme_get_cursor(theme->theme, name)
+                          : NULL;
+    if (!cursor) {
+      fprintf(stderr, "Cursor '%s' not found\n", name);
+    }
+    g_hash_table_insert(theme->cursors, g_strdup(name), cursor);
+  }
+  return cursor;
+}
+
+static void destroy_cursor_themes(void) {
+  struct cursor_theme *theme, *tmp;
+  wl_list_for_each_safe(theme, tmp, &cursor_themes, link) {
+    if (theme->theme) {
+      wl_cursor_theme_destroy(theme->theme);
+    }
+    g_hash_table_destroy(theme->cursors);
+    wl_list_remove(&theme->link);
+    free(theme);
+  }
+}
+
+static void cursor_stop_animation(struct seat *seat) {
+  if (seat->pointer.cursor_frame) {
+    wl_callback_destroy(seat->pointer.cursor_frame);
+    seat->pointer.cursor_frame = NULL;
+  }
+}
+
+static void cursor_update(struct seat *seat);
+
+static void cursor_frame_done(void *data, struct wl_callback *callback,
+                              uint32_t time) {
+  struct seat *seat = data;
+  wl_callback_destroy(callback);
+  seat->pointer.cursor_frame = NULL;
+  cursor_update(seat);
+}
+
+static const struct wl_callback_listener cursor_frame_listener = {
+    cursor_frame_done,
+};
+
+// Attaches the image of the seat's cursor that is due now. Animated cursors
+// ask for a frame to check again, so they only advance while the compositor is
+// showing them and static ones cost nothing once attached
+static void cursor_update(struct seat *seat) {
+  struct wl_cursor *cursor = seat->pointer.cursor;
+  struct wl_surface *surface = seat->pointer.cursor_surface;
+  bool animated = cursor->image_count > 1;
+
+  int frame = 0;
+  if (animated) {
+    int64_t now = g_get_monotonic_time() / 1000;
+    frame = wl_cursor_frame(cursor, now - seat->pointer.cursor_start);
+  }
+  struct wl_cursor_image *image = cursor->images[frame];
+  if (image == seat->pointer.cursor_image && !animated) {
+    return;
+  }
+
+  if (image != seat->pointer.cursor_image) {
+    wl_surface_attach(surface, wl_cursor_image_get_buffer(image), 0, 0);
+    wl_surface_damage_buffer(surface, 0, 0, INT32_MAX, INT32_MAX);
+    seat->pointer.cursor_image = image;
+  }
+  if (animated && !seat->pointer.cursor_frame) {
+    seat->pointer.cursor_frame = wl_surface_frame(surface);
+    wl_callback_add_listener(seat->pointer.cursor_frame,
+                             &cursor_frame_listener, seat);
+  }
+  wl_surface_commit(surface);
+}
+
+// Restarts an animation that was stopped when the shell went idle, which the
+// pointer moving again ends
+static void cursor_resume_animation(struct seat *seat) {
+  struct wl_cursor *cursor = seat->pointer.cursor;
+  if (cursor && cursor->image_count > 1 && !seat->pointer.cursor_frame) {
+    cursor_update(seat);
+  }
+}
+
+// Each seat has its own cursor surface, which keeps the image last attached
+// to it. Entering a surface needs a wl_pointer.set_cursor with the new serial,
+// but the image is only attached again when it differs
+static void set_cursor(struct seat *seat, struct desktop_surface *s,
+                       uint32_t serial) {
+  int32_t scale = s->output ? s->output->scale : 1;
+  struct wl_cursor *cursor = get_cursor(s->cursor, scale);
+  if (!cursor) {
+    return;
+  }
+
+  if (!seat->pointer.cursor_surface) {
+    seat->pointer.cursor_surface = wl_compositor_create_surface(compositor);
+  }
+  if (cursor != seat->pointer.cursor) {
+    cursor_stop_animation(seat);
+    seat->pointer.cursor = cursor;
+    seat->pointer.cursor_image = NULL;
+    seat->pointer.cursor_start = g_get_monotonic_time() / 1000;
+    wl_surface_set_buffer_scale(seat->pointer.cursor_surface, scale);
+  }
+  cursor_update(seat);
+
+  struct wl_cursor_image *image = seat->pointer.cursor_image;
+  wl_pointer_set_cursor(seat->pointer.pointer, serial,
+                        seat->pointer.cursor_surface, image->hotspot_x / scale,
+                        image->hotspot_y / scale);
+}
+
+// Desktop Shell
+static void desktop_shell_configure(
+    void *data, struct weston_desktop_shell *weston_desktop_shell,
+    uint32_t edges, struct wl_surface *surface, int32_t width, int32_t height) {
+
+  struct desktop_surface *s = wl_surface_get_user_data(surface);
+  s->configure(s, weston_desktop_shell, edges, surface, width, height);
+}
+
+static void desktop_shell_prepare_lock_surface(
+    void *data, struct weston_desktop_shell *weston_desktop_shell) {
+  // No lock screen implemented, unlock immediately
+  weston_desktop_shell_unlock(desktop_shell);
+}
+
+static void
+desktop_shell_grab_cursor(void *data,
+                          struct weston_desktop_shell *weston_desktop_shell,
+                          uint32_t cursor) {}
+
+static const struct weston_desktop_shell_listener desktop_shell_listener = {
+    desktop_shell_configure,
+    desktop_shell_prepare_lock_surface,
+    desktop_shell_grab_cursor,
+};
+
+// SHM
+static void shm_format(void *data, struct wl_shm *wl_shm, uint32_t format) {}
+
+static const struct wl_shm_listener shm_listener = {
+    shm_format,
+};
+
+// Surfaces
+static void surface_enter_output(void *data, struct wl_surface *wl_surface,
+                                 struct wl_output *output) {}
+static void surface_leave_output(void *data, struct wl_surface *wl_surface,
+                                 struct wl_output *output) {}
+
+static const struct wl_surface_listener desktop_surface_listener = {
+    surface_enter_output,
+    surface_leave_output,
+};
+
+// Wallpaper
+//
+// The background-image is decoded and fitted to the size of the output once,
+// and the pixels are written to a cache file that is shared with the
+// compositor as the wl_shm pool of the buffer. Later starts find the cache
+// file and hand it over without decoding or even mapping it. There is one
+// file per output size, which is replaced when the image path, the settings
+// that affect the pixels or the size and mtime of the image change.
+//
+// Finding or writing the cache file runs on a worker thread, so decoding a
+// large image doesn't hold up input or the other outputs. The main thread
+// shows the solid fill, or the wallpaper at its old size scaled by the
+// viewport, until the worker is done and then creates and commits the buffer
+#define WALLPAPER_MAGIC "WDMWALL"
+#define WALLPAPER_VERSION (2)
+// Pixels start on a page boundary after the header
+#define WALLPAPER_DATA_OFFSET (4096)
+
+struct wallpaper_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  int64_t image_mtime;
+  int64_t image_size;
+  // SHA-1 of the image path and settings, in hex
+  char settings[40];
+};
+
+static void set_source_color(cairo_t *cr, uint32_t color) {
+  cairo_set_source_rgb(cr, ((color >> 16) & 0xff) / 255.0,
+                       ((color >> 8) & 0xff) / 255.0, (color & 0xff) / 255.0);
+}
+
+#ifdef HAVE_JPEG
+struct jpeg_error {
+  struct jpeg_error_mgr base;
+  jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  struct jpeg_error *error = (struct jpeg_error *)cinfo->err;
+  longjmp(error->jump, 1);
+}
+
+// Decodes a JPEG, reduced by up to 8 times while decompressing as long as it
+// is still at least width by height
+static cairo_surface_t *load_jpeg(char const *path, uint32_t width,
+                                  uint32_t height) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error error;
+  cinfo.err = jpeg_std_error(&error.base);
+  error.base.error_exit = jpeg_error_exit;
+  cairo_surface_t *volatile image = NULL;
+  uint8_t *volatile row = NULL;
+  if (setjmp(error.jump)) {
+    error.base.output_message((j_common_ptr)&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    free(row);
+    if (image) {
+      cairo_surface_destroy(image);
+    }
+    return NULL;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, file);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1;
+  while (cinfo.scale_denom < 8 &&
+         cinfo.image_width / (cinfo.scale_denom * 2) >= width &&
+         cinfo.image_height / (cinfo.scale_denom * 2) >= height) {
+    cinfo.scale_denom *= 2;
+  }
+  jpeg_start_decompress(&cinfo);
+
+  image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, cinfo.output_width,
+                                     cinfo.output_height);
+  uint8_t *data = cairo_image_surface_get_data(image);
+  int stride = cairo_image_surface_get_stride(image);
+  row = malloc(cinfo.output_width * 3);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    uint32_t *pixels = (uint32_t *)(data + cinfo.output_scanline * stride);
+    JSAMPROW rows[] = {row};
+    jpeg_read_scanlines(&cinfo, rows, 1);
+    for (JDIMENSION x = 0; x < cinfo.output_width; x++) {
+      uint8_t *rgb = &row[x * 3];
+      pixels[x] = 0xff000000 | rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+    }
+  }
+  cairo_surface_mark_dirty(image);
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(file);
+  free(row);
+  return image;
+}
+#endif
+
+// Decodes a PNG or JPEG, telling them apart by their signature
+static cairo_surface_t *load_image(char const *path, uint32_t width,
+                                   uint32_t height) {
+  uint8_t magic[4] = {0};
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Unable to open background image '%s': %s\n", path,
+            strerror(errno));
+    return NULL;
+  }
+  size_t len = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+
+  cairo_surface_t *image = NULL;
+  if (len == sizeof(magic) && memcmp(magic, "\x89PNG", 4) == 0) {
+    image = cairo_image_surface_create_from_png(path);
+    if (cairo_surface_status(image)) {
+      fprintf(stderr, "Unable to load background image '%s': %s\n", path,
+              cairo_status_to_string(cairo_surface_status(image)));
+      cairo_surface_destroy(image);
+      image = NULL;
+    }
+  } else if (len >= 3 && memcmp(magic, "\xff\xd8\xff", 3) == 0) {
+#ifdef HAVE_JPEG
+    image = load_jpeg(path, width, height);
+    if (!image) {
+      fprintf(stderr, "Unable to load background image '%s'\n", path);
+    }
+#else
+    fprintf(stderr, "Background image '%s' is a JPEG, which isn't supported\n",
+            path);
+#endif
+  } else {
+    fprintf(stderr, "Background image '%s' isn't a PNG or JPEG\n", path);
+  }
+  return image;
+}
+
+// Draws the image over the background-color the way background-type says
+static void paint_wallpaper(cairo_t *cr, cairo_surface_t *image,
+                            uint32_t width, uint32_t height) {
+  set_source_color(cr, config.background_color);
+  cairo_paint(cr);
+
+  double image_width = cairo_image_surface_get_width(image);
+  double image_height = cairo_image_surface_get_height(image);
+  double sx = width / image_width;
+  double sy = height / image_height;
+  switch (config.background_type) {
+  case BACKGROUND_SCALE:
+    break;
+  case BACKGROUND_SCALE_CROP:
+    sx = sy = fmax(sx, sy);
+    break;
+  case BACKGROUND_TILE:
+  case BACKGROUND_CENTERED:
+    sx = sy = 1;
+    break;
+  }
+  if (config.background_type != BACKGROUND_TILE) {
+    cairo_translate(cr, (width - image_width * sx) / 2,
+                    (height - image_height * sy) / 2);
+  }
+  cairo_scale(cr, sx, sy);
+  cairo_set_source_surface(cr, image, 0, 0);
+  cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+  if (config.background_type == BACKGROUND_TILE) {
+    cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_REPEAT);
+  }
+  cairo_paint(cr);
+}
+
+static char *wallpaper_cache_path(uint32_t width, uint32_t height) {
+  char *name = g_strdup_printf("%ux%u.raw", width, height);
+  char *path = g_build_filename(g_get_user_cache_dir(),
+                                "weston-desktop-matchbox", "wallpapers", name,
+                                NULL);
+  g_free(name);
+  return path;
+}
+
+static void wallpaper_header_init(struct wallpaper_header *header,
+                                  struct stat const *st, uint32_t width,
+                                  uint32_t height) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, WALLPAPER_MAGIC, sizeof(header->magic));
+  header->version = WALLPAPER_VERSION;
+  header->width = width;
+  header->height = height;
+  header->stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+  header->image_mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+  header->image_size = st->st_size;
+
+  char *key = g_strdup_printf("%s\n%d\n%08x", config.background_image,
+                              config.background_type, config.background_color);
+  char *checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+  memcpy(header->settings, checksum, sizeof(header->settings));
+  g_free(checksum);
+  g_free(key);
+}
+
+// Returns the cache file if it was written for this version of the image, or -1
+static int open_wallpaper_cache(char const *path,
+                                struct wallpaper_header const *expected) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct wallpaper_header header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(&header, expected, sizeof(header)) != 0 || fstat(fd, &st) < 0 ||
+      st.st_size < WALLPAPER_DATA_OFFSET +
+                       (off_t)expected->stride * expected->height) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Decodes the image into a new cache file, or into memory if it can't be
+// written
+static int write_wallpaper_cache(char const *path,
+                                 struct wallpaper_header const *header) {
+  cairo_surface_t *image =
+      load_image(config.background_image, header->width, header->height);
+  if (!image) {
+    return -1;
+  }
+
+  // Outputs of the same size load the same file at the same time, so each
+  // writes its own temporary file, which the rename then replaces atomically
+  char *dir = g_path_get_dirname(path);
+  char *tmp = g_strconcat(path, ".XXXXXX", NULL);
+  int fd = -1;
+  if (g_mkdir_with_parents(dir, 0700) == 0) {
+    fd = g_mkstemp_full(tmp, O_RDWR | O_CLOEXEC, 0600);
+  }
+  bool cached = fd >= 0;
+  if (!cached) {
+    fprintf(stderr, "Unable to write wallpaper cache '%s': %s\n", tmp,
+            strerror(errno));
+    fd = memfd_create("wallpaper", MFD_CLOEXEC);
+  }
+
+  size_t size = WALLPAPER_DATA_OFFSET + (size_t)header->stride * header->height;
+  uint8_t *data = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, size) == 0) {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (data == MAP_FAILED) {
+    perror("Unable to create wallpaper");
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    if (cached) {
+      unlink(tmp);
+    }
+    goto out;
+  }
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      data + WALLPAPER_DATA_OFFSET, CAIRO_FORMAT_RGB24, header->width,
+      header->height, header->stride);
+  cairo_t *cr = cairo_create(surface);
+  paint_wallpaper(cr, image, header->width, header->height);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+
+  // The header goes in last so that a partly written file is never valid
+  memcpy(data, header, sizeof(*header));
+  munmap(data, size);
+  if (cached && rename(tmp, path) < 0) {
+    perror("Unable to rename wallpaper cache");
+    unlink(tmp);
+  }
+
+out:
+  cairo_surface_destroy(image);
+  g_free(tmp);
+  g_free(dir);
+  return fd;
+}
+
+struct wallpaper_size {
+  uint32_t width;
+  uint32_t height;
+};
+
+// Returns the fd of the background-image at the given size, or -1
+static void prepare_wallpaper(GTask *task, gpointer source, gpointer data,
+                              GCancellable *cancellable) {
+  TRACE_BEGIN(start);
+  struct wallpaper_size *size = data;
+  struct stat st;
+  if (stat(config.background_image, &st) < 0) {
+    fprintf(stderr, "Unable to open background image '%s': %s\n",
+            config.background_image, strerror(errno));
+    g_task_return_int(task, -1);
+    return;
+  }
+
+  struct wallpaper_header header;
+  wallpaper_header_init(&header, &st, size->width, size->height);
+  char *path = wallpaper_cache_path(size->width, size->height);
+  int fd = open_wallpaper_cache(path, &header);
+  if (fd < 0) {
+    fd = write_wallpaper_cache(path, &header);
+  }
+  g_free(path);
+  TRACE_END(start, "wallpaper prepare");
+  g_task_return_int(task, fd);
+}
+
+static struct wl_buffer *create_wallpaper_buffer(int fd, uint32_t width,
+                                                 uint32_t height) {
+  // The buffer keeps the memory of the pool, which the shell never maps
+  int32_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+  int32_t size = WALLPAPER_DATA_OFFSET + stride * height;
+  struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+  struct wl_buffer *buffer =
+      wl_shm_pool_create_buffer(pool, WALLPAPER_DATA_OFFSET, width, height,
+                                stride, WL_SHM_FORMAT_XRGB8888);
+  wl_shm_pool_destroy(pool);
+  return buffer;
+}
+
+static void show_wallpaper(struct background *background) {
+  wl_surface_attach(background->surface, background->wallpaper, 0, 0);
+  wl_surface_damage_buffer(background->surface, 0, 0, INT32_MAX, INT32_MAX);
+  wp_viewport_set_destination(background->viewport, background->width,
+                              background->height);
+  wl_surface_commit(background->surface);
+  finish_swapchain(&background->swapchain);
+}
+
+static void wallpaper_loaded(GObject *source, GAsyncResult *result,
+                             gpointer data) {
+  GTask *task = G_TASK(result);
+  int fd = g_task_propagate_int(task, NULL);
+  if (g_cancellable_is_cancelled(g_task_get_cancellable(task))) {
+    // Replaced by a load at another size, or the output is gone
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+
+  struct background *background = data;
+  struct wallpaper_size *size = g_task_get_task_data(task);
+  g_clear_object(&background->wallpaper_load);
+  if (fd < 0) {
+    background->wallpaper_failed = true;
+    return;
+  }
+
+  struct wl_buffer *old = background->wallpaper;
+  background->wallpaper =
+      create_wallpaper_buffer(fd, size->width, size->height);
+  background->wallpaper_width = size->width;
+  background->wallpaper_height = size->height;
+  close(fd);
+  show_wallpaper(background);
+  // Only destroyed once it has been replaced
+  if (old) {
+    wl_buffer_destroy(old);
+  }
+}
+
+static void start_wallpaper_load(struct background *background, uint32_t width,
+                                 uint32_t height) {
+  if (background->wallpaper_load) {
+    if (background->load_width == width && background->load_height == height) {
+      return;
+    }
+    g_cancellable_cancel(background->wallpaper_load);
+    g_clear_object(&background->wallpaper_load);
+  }
+
+  struct wallpaper_size *size = g_new(struct wallpaper_size, 1);
+  size->width = width;
+  size->height = height;
+  background->wallpaper_load = g_cancellable_new();
+  background->load_width = width;
+  background->load_height = height;
+
+  GTask *task = g_task_new(NULL, background->wallpaper_load, wallpaper_loaded,
+                           background);
+  // The fd has to be returned even if the load is cancelled, to be closed
+  g_task_set_check_cancellable(task, FALSE);
+  g_task_set_task_data(task, size, g_free);
+  g_task_run_in_thread(task, prepare_wallpaper);
+  g_object_unref(task);
+}
+
+// Shows the background-image if it is ready, starting to prepare it if it
+// isn't at the current size. Returns false if the solid fill should be drawn
+static bool draw_wallpaper(struct background *background) {
+  int32_t scale = background->output->scale;
+  uint32_t width = background->width * scale;
+  uint32_t height = background->height * scale;
+  if (!background->wallpaper || background->wallpaper_width != width ||
+      background->wallpaper_height != height) {
+    start_wallpaper_load(background, width, height);
+  }
+
+  if (!background->wallpaper) {
+    return false;
+  }
+  TRACE_BEGIN(start);
+  show_wallpaper(background);
+  TRACE_END(start, "background wallpaper commit");
+  return true;
+}
+
+// Background surface
+static void background_buffer_released(void *data) {
+  struct background *background = data;
+  if (background->needs_draw) {
+    draw_background(background);
+  }
+}
+
+static void draw_background(struct background *background) {
+  TRACE_BEGIN(start);
+  background->needs_draw = false;
+  if (config.background_image && !background->wallpaper_failed &&
+      draw_wallpaper(background)) {
+    return;
+  }
+
+  uint32_t width = 1;
+  uint32_t height = 1;
+  if (config.background_downscale > 0) {
+    width = MAX(background->width / config.background_downscale, 1);
+    height = MAX(background->height / config.background_downscale, 1);
+  }
+  uint32_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+  swapchain_resize(&background->swapchain, width, height, stride);
+
+  cairo_rectangle_int_t rect = {0, 0, width, height};
+  cairo_region_t *damage = cairo_region_create_rectangle(&rect);
+
+  TRACE_BEGIN(acquire_start);
+  struct buffer *buffer = swapchain_acquire(&background->swapchain, damage);
+  TRACE_END(acquire_start, "background acquire");
+  if (!buffer) {
+    background->needs_draw = true;
+    cairo_region_destroy(damage);
+    return;
+  }
+
+  TRACE_BEGIN(fill_start);
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      buffer_data(buffer), CAIRO_FORMAT_RGB24, width, height, stride);
+  cairo_t *cr = cairo_create(surface);
+
+  set_source_color(cr, config.background_color);
+  cairo_paint(cr);
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  TRACE_END(fill_start, "background fill");
+
+  TRACE_BEGIN(commit_start);
+  swapchain_present(&background->swapchain, buffer, background->surface,
+                    damage);
+  cairo_region_destroy(damage);
+
+  wp_viewport_set_destination(background->viewport, background->width,
+                              background->height);
+  wl_surface_commit(background->surface);
+  TRACE_END(commit_start, "background commit");
+  TRACE_END(start, "draw_background");
+}
+
+static void menu_configure(struct menu *menu);
+
+static void background_configure(
+    void *data, struct weston_desktop_shell *weston_desktop_shell,
+    uint32_t edges, struct wl_surface *surface, int32_t width, int32_t height) {
+  struct background *background = data;
+  bool resized = background->width != width || background->height != height;
+  background->width = width;
+  background->height = height;
+
+  // The menu is desynchronized, so it must be committed first for its new
+  // position to be applied by the commit of the background
+  menu_configure(background->menu);
+
+  // The backdrop never changes otherwise, so it is only committed when the
+  // output changes size
+  if (resized || (!background->swapchain.front && !background->wallpaper)) {
+    draw_background(background);
+  }
+}
+
+static void menu_pointer_scroll(void *data, struct seat *seat,
+                                struct pointer_scroll const *scroll);
+
+static void background_pointer_scroll(void *data, struct seat *seat,
+                                      struct pointer_scroll const *scroll) {
+  struct background *background = data;
+  // Scrolling anywhere on the output scrolls the menu
+  menu_pointer_scroll(background->menu, seat, scroll);
+}
+
+static void open_search(struct output *output);
+
+static void background_pointer_button(void *data, struct seat *seat,
+                                      uint32_t button, uint32_t state) {
+  struct background *background = data;
+  if (button == BTN_LEFT && state == WL_POINTER_BUTTON_STATE_RELEASED) {
+    open_search(background->output);
+  }
+}
+
+// Space the panel takes at the top of the output
+static int panel_top(void) {
+  return config.panel_position == WESTON_DESKTOP_SHELL_PANEL_POSITION_TOP
+             ? PANEL_HEIGHT
+             : 0;
+}
+
+// Menu
+// Kinetic scrolling slows down by a factor of e every this many milliseconds,
+// and stops below the minimum speed in pixels per millisecond
+#define KINETIC_TIME_CONSTANT (325.0)
+#define KINETIC_MIN_VELOCITY (0.02)
+// Frame interval assumed for the first step, before there is a previous frame
+// to measure from
+#define KINETIC_FIRST_FRAME_MS (16)
+
+// Moves kinetic scrolling on to the frame at time
+static void menu_kinetic_step(struct menu *menu, uint32_t time) {
+  uint32_t dt =
+      menu->kinetic_time ? time - menu->kinetic_time : KINETIC_FIRST_FRAME_MS;
+  menu->kinetic_time = time;
+
+  menu->pending_scroll += menu->kinetic_velocity * dt;
+  menu->kinetic_velocity *= exp(-(double)dt / KINETIC_TIME_CONSTANT);
+  if (fabs(menu->kinetic_velocity) < KINETIC_MIN_VELOCITY) {
+    menu->kinetic_velocity = 0;
+  }
+}
+
+static void menu_frame_done(void *data, struct wl_callback *wl_callback,
+                            uint32_t callback_data) {
+  struct menu *menu = data;
+#ifdef HAVE_TRACING
+  trace_async("menu frame callback", NULL, (uintptr_t)menu,
+              menu->frame_requested, g_get_monotonic_time());
+#endif
+  wl_callback_destroy(menu->frame);
+  menu->frame = NULL;
+  if (menu->kinetic_velocity) {
+    menu_kinetic_step(menu, callback_data);
+    menu->needs_draw = true;
+  }
+  if (menu->needs_draw) {
+    draw_menu(menu);
+  }
+#ifdef HAVE_BENCHMARK
+  benchmark_frame_done(menu);
+#endif
+}
+
+static const struct wl_callback_listener menu_frame_listener = {
+    menu_frame_done,
+};
+
+// Asks for a frame callback without drawing, so that kinetic scrolling can
+// start on the frame clock
+static void menu_request_frame(struct menu *menu) {
+  if (!menu->frame) {
+    menu->frame = wl_surface_frame(menu->surface);
+    wl_callback_add_listener(menu->frame, &menu_frame_listener, menu);
+    TRACE_STAMP(menu->frame_requested);
+    wl_surface_commit(menu->surface);
+  }
+}
+
+static void menu_buffer_released(void *data) {
+  struct menu *menu = data;
+  if (menu->needs_draw) {
+    draw_menu(menu);
+  }
+}
+
+// Number of rows the menu shows with the current filter. Without one the
+// frequent applications come first, followed by all of them
+static guint menu_row_count(struct menu *menu) {
+  return menu->matches ? menu->matches->len
+                       : frequent_apps->len + application_list->len;
+}
+
+static struct app_entry *menu_row_entry(struct menu *menu, guint row) {
+  if (menu->matches) {
+    row = g_array_index(menu->matches, guint, row);
+  } else if (row < frequent_apps->len) {
+    return frequent_apps->pdata[row];
+  } else {
+    row -= frequent_apps->len;
+  }
+  return application_list->pdata[row];
+}
+
+// The menu is drawn scrolled by a whole number of pixels, so that scrolling
+// moves what was drawn before without changing it
+static int menu_scroll_px(double y_scroll) {
+  return round(y_scroll);
+}
+
+// Position of the top of a row in the list, unscrolled
+static int menu_row_top(struct menu *menu, int row) {
+  return round(menu->rows->padding + row * menu->extents.height);
+}
+
+// Surface coordinate of the top of a row
+static int menu_row_y(struct menu *menu, int row) {
+  return menu_row_top(menu, row) - menu_scroll_px(menu->y_scroll);
+}
+
+// Returns the index of the menu row at surface coordinate y, or -1 if there is
+// no row there
+static int menu_row_at(struct menu *menu, double y) {
+  if (!menu->extents.height || y < 0) {
+    return -1;
+  }
+
+  double menu_y =
+      y * menu->scale + menu_scroll_px(menu->y_scroll) - menu->rows->padding;
+  if (menu_y < 0) {
+    return -1;
+  }
+
+  guint row = menu_y / menu->extents.height;
+  if (row >= menu_row_count(menu)) {
+    return -1;
+  }
+  return row;
+}
+
+// Adds the area covered by a menu row to region, in the coordinates of a
+// buffer holding the strip of the list that starts at top
+static void menu_damage_row(struct menu *menu, cairo_region_t *region,
+                            int row, int top, uint32_t height) {
+  if (row < 0) {
+    return;
+  }
+
+  cairo_rectangle_int_t rect = {
+      .x = 0,
+      .y = menu_row_top(menu, row) - top,
+      .width = menu->width,
+      .height = ceil(menu->extents.height),
+  };
+  cairo_region_union_rectangle(region, &rect);
+
+  cairo_rectangle_int_t bounds = {0, 0, menu->width, height};
+  cairo_region_intersect_rectangle(region, &bounds);
+}
+
+static void menu_clamp_scroll(struct menu *menu) {
+  double total_height = menu_row_count(menu) * menu->extents.height;
+  double max_y_scroll =
+      total_height - ((double)menu->height - menu->rows->padding * 2);
+  if (max_y_scroll > 0) {
+    menu->y_scroll = fmax(menu->y_scroll, 0);
+    menu->y_scroll = fmin(menu->y_scroll, max_y_scroll);
+  } else {
+    menu->y_scroll = 0;
+  }
+}
+
+// Fills rows with the row under each seat's pointer, in seat order
+static void menu_find_hover_rows(struct menu *menu, GArray *rows) {
+  g_array_set_size(rows, 0);
+  struct seat *seat;
+  wl_list_for_each(seat, &seat_list, link) {
+    if (seat->pointer.surface == &menu->base) {
+      int row = menu_row_at(menu, seat->pointer.y);
+      if (row >= 0) {
+        g_array_append_val(rows, row);
+      }
+    }
+  }
+}
+
+static bool menu_row_hovered(GArray *rows, int row) {
+  for (guint i = 0; i < rows->len; i++) {
+    if (g_array_index(rows, int, i) == row) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool menu_hover_changed(struct menu *menu) {
+  GArray *rows = menu->hover_rows;
+  GArray *drawn = menu->drawn_hover_rows;
+  return rows->len != drawn->len ||
+         memcmp(rows->data, drawn->data, rows->len * sizeof(int)) != 0;
+}
+
+// The row under the seat's pointer if it is on the menu, or -1
+static int menu_seat_row(struct menu *menu, struct seat *seat) {
+  if (seat->pointer.surface != &menu->base) {
+    return -1;
+  }
+  return menu_row_at(menu, seat->pointer.y);
+}
+
+// Redraws the menu only if the scroll offset or the rows under the pointers
+// differ from what is currently displayed
+static void menu_update(struct menu *menu) {
+  menu_clamp_scroll(menu);
+  menu_find_hover_rows(menu, menu->hover_rows);
+  if (menu->pending_scroll || menu->y_scroll != menu->drawn_y_scroll ||
+      menu_hover_changed(menu)) {
+    draw_menu(menu);
+  }
+}
+
+// Whether the surface shows a frame that the next one can be based on
+static bool menu_has_front(struct menu *menu) {
+#ifdef HAVE_EGL
+  if (menu->egl_surface) {
+    return menu->egl_drawn;
+  }
+#endif
+  return menu->swapchain.front;
+}
+
+// Records what the frame that is about to be committed shows, and asks to be
+// told when to draw the next one
+static void menu_frame_drawn(struct menu *menu, guint row_count) {
+  menu->needs_full_draw = false;
+  g_array_set_size(menu->drawn_hover_rows, menu->hover_rows->len);
+  if (menu->hover_rows->len) {
+    memcpy(menu->drawn_hover_rows->data, menu->hover_rows->data,
+           menu->hover_rows->len * sizeof(int));
+  }
+  menu->drawn_y_scroll = menu->y_scroll;
+  g_ptr_array_set_size(menu->drawn_rows, row_count);
+  for (guint row = 0; row < row_count; row++) {
+    menu->drawn_rows->pdata[row] = menu_row_entry(menu, row);
+  }
+
+  menu->frame = wl_surface_frame(menu->surface);
+  wl_callback_add_listener(menu->frame, &menu_frame_listener, menu);
+  TRACE_STAMP(menu->frame_requested);
+#ifdef HAVE_BENCHMARK
+  benchmark_frame_drawn(menu);
+#endif
+}
+
+#ifdef HAVE_EGL
+// Destroys the EGL surface of the menu, after which it is drawn with wl_shm
+static void menu_finish_egl(struct menu *menu) {
+  // A current surface is only destroyed once it is released
+  if (eglGetCurrentSurface(EGL_DRAW) == menu->egl_surface) {
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+  }
+  eglDestroySurface(egl_display, menu->egl_surface);
+  wl_egl_window_destroy(menu->egl_window);
+  menu->egl_surface = EGL_NO_SURFACE;
+  menu->egl_window = NULL;
+  menu->egl_drawn = false;
+}
+
+// Moves every menu over to wl_shm, for when GL turns out to be unusable
+static void drop_egl(void) {
+  struct output *output;
+  wl_list_for_each(output, &output_list, link) {
+    struct menu *menu = output->background ? output->background->menu : NULL;
+    if (menu && menu->egl_surface) {
+      menu_finish_egl(menu);
+      menu->needs_full_draw = true;
+    }
+  }
+  finish_egl();
+}
+
+// Redraws the whole menu with GL and commits it. Returns false if GL can't be
+// used, in which case every menu has been moved over to wl_shm
+static bool draw_menu_gl(struct menu *menu, guint row_count) {
+  TRACE_BEGIN(start);
+  eglMakeCurrent(egl_display, menu->egl_surface, menu->egl_surface,
+                 egl_context);
+  if (!gl_program && !init_gl_program()) {
+    fprintf(stderr, "Unable to draw with GL, using wl_shm\n");
+    drop_egl();
+    return false;
+  }
+  delete_dead_textures();
+  if (!menu->egl_drawn) {
+    // Frames are paced by the menu's own frame callbacks, so swapping must
+    // never block the main loop waiting for one
+    eglSwapInterval(egl_display, 0);
+  }
+
+  glViewport(0, 0, menu->width, menu->height);
+  glClearColor(0.5, 0.5, 0.5, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  glUseProgram(gl_program);
+  glUniform2f(gl_size_uniform, menu->width, menu->height);
+  glEnable(GL_BLEND);
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+
+  double top = menu_scroll_px(menu->y_scroll) - menu->rows->padding;
+  int first = MAX(floor(top / menu->extents.height) - 1, 0);
+  int last = MIN(ceil((top + menu->height) / menu->extents.height),
+                 (int)row_count - 1);
+  for (int row = first; row <= last; row++) {
+    struct app_entry *entry = menu_row_entry(menu, row);
+    cairo_surface_t *mask = row_cache_get(menu->rows, entry->name);
+    glBindTexture(GL_TEXTURE_2D, mask_texture(mask));
+    if (menu_row_hovered(menu->hover_rows, row)) {
+      glUniform3f(gl_color_uniform, 0, 1, 1);
+    } else {
+      glUniform3f(gl_color_uniform, 0, 0, 0);
+    }
+
+    GLfloat x = cairo_image_surface_get_width(mask);
+    GLfloat y = menu_row_y(menu, row);
+    GLfloat height = cairo_image_surface_get_height(mask);
+    GLfloat u = x / cairo_image_surface_get_stride(mask);
+    GLfloat positions[] = {0, y, x, y, 0, y + height, x, y + height};
+    GLfloat texcoords[] = {0, 0, u, 0, 0, 1, u, 1};
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, positions);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  }
+
+  TRACE_END(start, "menu gl draw");
+
+  TRACE_BEGIN(swap_start);
+  menu_frame_drawn(menu, row_count);
+  eglSwapBuffers(egl_display, menu->egl_surface);
+  menu->egl_drawn = true;
+  TRACE_END(swap_start, "menu gl swap");
+  return true;
+}
+#endif
+
+// Height of the buffers the menu is drawn into. GL redraws everything on each
+// frame, so only the wl_shm buffers hold more than is shown
+static uint32_t menu_strip_height(struct menu *menu) {
+#ifdef HAVE_EGL
+  if (menu->egl_surface) {
+    return menu->height;
+  }
+#endif
+  return menu->strip_height;
+}
+
+// Returns where in the list the strip the buffers hold starts. It stays put
+// while it still covers everything shown, otherwise it is centred on the view
+// without going past either end of the list
+static int menu_place_strip(struct menu *menu, guint row_count,
+                            uint32_t strip_height, bool keep) {
+  int view = menu_scroll_px(menu->y_scroll);
+  int top = menu->drawn_strip_top;
+  if (keep && view >= top &&
+      view + (int)menu->height <= top + (int)strip_height) {
+    return top;
+  }
+
+  int list_height =
+      ceil(row_count * menu->extents.height) + menu->rows->padding * 2;
+  top = view - (int)(strip_height - menu->height) / 2;
+  return CLAMP(top, 0, MAX(list_height - (int)strip_height, 0));
+}
+
+// Shows the part of the strip in the front buffer that the last frame drawn
+// was scrolled to, which is width by height
+static void menu_set_source(struct menu *menu, uint32_t width,
+                            uint32_t height) {
+  int y = menu_scroll_px(menu->drawn_y_scroll) - menu->drawn_strip_top;
+  wp_viewport_set_source(menu->viewport, wl_fixed_from_int(0),
+                         wl_fixed_from_int(y), wl_fixed_from_int(width),
+                         wl_fixed_from_int(height));
+}
+
+// Menu rendering
+//
+// Frames drawn with wl_shm are rasterized by a worker thread, into a buffer
+// of the swapchain that the main thread has acquired, so that a slow render
+// on one output never holds up input on the others. The main thread works out
+// what to draw beforehand and commits the buffer once the worker is done.
+// Until then the frame callback requested for that commit keeps the menu from
+// being drawn again, so nothing else allocates from its pool and the mapping
+// the worker draws into stays put
+struct menu_render_row {
+  char *text;
+  // Top of the row in the buffer
+  int y;
+  bool hovered;
+  // A reference to the cached mask, or NULL for the worker to render one
+  cairo_surface_t *mask;
+  bool rendered;
+};
+
+struct menu_render {
+  // NULL if the menu was destroyed meanwhile, which leaves the pool to this
+  struct menu *menu;
+  struct shm_pool *pool;
+  struct row_cache *rows;
+  struct buffer *buffer;
+  uint8_t *data;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  // The last frame, to be moved down by shift, or NULL
+  uint8_t *front;
+  int shift;
+  // Area to draw, and the area of the buffer that changes
+  cairo_region_t *damage;
+  cairo_region_t *changed;
+  // Height of the part of the buffer the viewport shows
+  uint32_t view_height;
+  GArray *draw_rows;
+};
+
+static void free_menu_render(struct menu_render *render) {
+  for (guint i = 0; i < render->draw_rows->len; i++) {
+    struct menu_render_row *row =
+        &g_array_index(render->draw_rows, struct menu_render_row, i);
+    g_free(row->text);
+    if (row->mask) {
+      cairo_surface_destroy(row->mask);
+    }
+  }
+  g_array_free(render->draw_rows, TRUE);
+  cairo_region_destroy(render->damage);
+  cairo_region_destroy(render->changed);
+  row_cache_unref(render->rows);
+  if (!render->menu) {
+    finish_shm_pool(render->pool);
+    free(render->pool);
+  }
+  free(render);
+}
+
+// Runs on a worker thread, touching nothing but the buffer and the render
+static void render_menu(GTask *task, gpointer source, gpointer data,
+                        GCancellable *cancellable) {
+  struct menu_render *render = data;
+  TRACE_BEGIN(fill_start);
+  if (render->front) {
+    // The buffer may be the front buffer itself, so the rows are moved with
+    // memmove()
+    size_t stride = render->stride;
+    size_t kept = (render->height - abs(render->shift)) * stride;
+    if (render->shift > 0) {
+      memmove(render->data + render->shift * stride, render->front, kept);
+    } else {
+      memmove(render->data, render->front - render->shift * stride, kept);
+    }
+  }
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      render->data, CAIRO_FORMAT_RGB24, render->width, render->height,
+      render->stride);
+  cairo_t *cr = cairo_create(surface);
+
+  int num_rects = cairo_region_num_rectangles(render->damage);
+  for (int i = 0; i < num_rects; i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(render->damage, i, &rect);
+    cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_clip(cr);
+
+  cairo_set_source_rgb(cr, 0.5, 0.5, 0.5);
+  cairo_paint(cr);
+  TRACE_END(fill_start, "menu fill");
+
+  TRACE_BEGIN(text_start);
+  cairo_t *layout = NULL;
+  for (guint i = 0; i < render->draw_rows->len; i++) {
+    struct menu_render_row *row =
+        &g_array_index(render->draw_rows, struct menu_render_row, i);
+    if (!row->mask) {
+      if (!layout) {
+        // Only measures, it never draws
+        layout = cairo_create(surface);
+        set_menu_font(layout, render->rows->scale);
+      }
+      row->mask = render_row(render->rows, layout, row->text);
+      row->rendered = true;
+    }
+    if (row->hovered) {
+      cairo_set_source_rgb(cr, 0, 1, 1);
+    } else {
+      cairo_set_source_rgb(cr, 0, 0, 0);
+    }
+    cairo_mask_surface(cr, row->mask, 0, row->y);
+  }
+  if (layout) {
+    cairo_destroy(layout);
+  }
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  TRACE_END(text_start, "menu text");
+  g_task_return_boolean(task, TRUE);
+}
+
+static void menu_render_done(GObject *source, GAsyncResult *result,
+                             gpointer data) {
+  struct menu_render *render = data;
+  struct menu *menu = render->menu;
+  if (!menu) {
+    free_menu_render(render);
+    return;
+  }
+  menu->render = NULL;
+
+  // The masks the worker rendered are kept for the next frames
+  for (guint i = 0; i < render->draw_rows->len; i++) {
+    struct menu_render_row *row =
+        &g_array_index(render->draw_rows, struct menu_render_row, i);
+    if (row->rendered &&
+        !g_hash_table_contains(render->rows->rows, row->text)) {
+      g_hash_table_insert(render->rows->rows, g_strdup(row->text),
+                          cairo_surface_reference(row->mask));
+    }
+  }
+
+  TRACE_BEGIN(commit_start);
+  swapchain_present(&menu->swapchain, render->buffer, menu->surface,
+                    render->changed);
+  menu_set_source(menu, render->width, render->view_height);
+  wl_surface_commit(menu->surface);
+  TRACE_END(commit_start, "menu commit");
+  free_menu_render(render);
+
+  // Idling drops the frame callback there is no draw waiting for
+  if (menu->needs_draw && !menu->frame) {
+    draw_menu(menu);
+  }
+}
+
+// Hands drawing damage into buffer, and moving the last frame down by shift,
+// to a worker. The rows that overlap damage are looked up here, along with the
+// masks there already are for them
+static void start_menu_render(struct menu *menu, struct buffer *buffer,
+                              struct buffer *front, int shift, int strip_top,
+                              guint row_count, cairo_region_t *damage,
+                              cairo_region_t *changed) {
+  struct menu_render *render = calloc(1, sizeof(*render));
+  render->menu = menu;
+  render->pool = menu->pool;
+  render->rows = row_cache_ref(menu->rows->scale_120);
+  render->buffer = buffer;
+  render->data = buffer_data(buffer);
+  render->width = buffer->width;
+  render->height = buffer->height;
+  render->stride = buffer->stride;
+  render->front = shift ? buffer_data(front) : NULL;
+  render->shift = shift;
+  render->damage = damage;
+  render->changed = changed;
+  render->view_height = menu->height;
+  render->draw_rows = g_array_new(FALSE, FALSE, sizeof(struct menu_render_row));
+
+  cairo_rectangle_int_t clip;
+  cairo_region_get_extents(damage, &clip);
+  double top = clip.y + strip_top - menu->rows->padding;
+  int first = MAX(floor(top / menu->extents.height) - 1, 0);
+  int last = MIN(ceil((top + clip.height) / menu->extents.height),
+                 (int)row_count - 1);
+  for (int i = first; i <= last; i++) {
+    struct app_entry *entry = menu_row_entry(menu, i);
+    cairo_surface_t *mask = g_hash_table_lookup(menu->rows->rows, entry->name);
+    struct menu_render_row row = {
+        .text = g_strdup(entry->name),
+        .y = menu_row_top(menu, i) - strip_top,
+        .hovered = menu_row_hovered(menu->hover_rows, i),
+        .mask = mask ? cairo_surface_reference(mask) : NULL,
+    };
+    g_array_append_val(render->draw_rows, row);
+  }
+
+  // The buffer is only attached once the worker is done, and must not be
+  // acquired again before that
+  buffer->busy = true;
+  menu->render = render;
+  GTask *task = g_task_new(NULL, NULL, menu_render_done, render);
+  g_task_set_task_data(task, render, NULL);
+  g_task_run_in_thread(task, render_menu);
+  g_object_unref(task);
+}
+
+static void draw_menu(struct menu *menu) {
+  if (menu->frame || menu->render) {
+    // Can't draw right now. Flag as needing to redraw when the frame callback
+    // finishes
+    menu->needs_draw = true;
+    return;
+  }
+  menu->needs_draw = false;
+#ifdef HAVE_BENCHMARK
+  benchmark_draw_started(menu);
+#endif
+
+  // Scrolling is applied once per frame, however many events arrived
+  double y_scroll = menu->y_scroll + menu->pending_scroll;
+  menu->y_scroll = y_scroll;
+  menu->pending_scroll = 0;
+  menu_clamp_scroll(menu);
+  if (menu->kinetic_velocity && menu->y_scroll != y_scroll) {
+    // Ran into the end of the list
+    menu->kinetic_velocity = 0;
+  }
+
+  menu_find_hover_rows(menu, menu->hover_rows);
+
+  uint32_t strip_height = menu_strip_height(menu);
+  uint32_t stride =
+      cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, menu->width);
+  swapchain_resize(&menu->swapchain, menu->width, strip_height, stride);
+
+  // Work out what changed since the last frame. Scrolling within the strip the
+  // buffers hold only moves the viewport. Once the view leaves it the strip
+  // moves, taking the contents of the last frame along, and only the part it
+  // uncovers is drawn. Otherwise only the rows that changed highlight or now
+  // show a different application need to be redrawn
+  guint row_count = menu_row_count(menu);
+  bool full_draw = !menu_has_front(menu) || menu->needs_full_draw;
+  int strip_top = menu_place_strip(menu, row_count, strip_height, !full_draw);
+  cairo_rectangle_int_t bounds = {0, 0, menu->width, strip_height};
+  // Distance the last frame moves down by
+  int shift = menu->drawn_strip_top - strip_top;
+  cairo_region_t *damage;
+  if (full_draw || abs(shift) >= (int)strip_height) {
+    shift = 0;
+    damage = cairo_region_create_rectangle(&bounds);
+  } else {
+    damage = cairo_region_create();
+    if (shift) {
+      cairo_rectangle_int_t exposed = {
+          .x = 0,
+          .y = shift > 0 ? 0 : strip_height + shift,
+          .width = menu->width,
+          .height = abs(shift),
+      };
+      cairo_region_union_rectangle(damage, &exposed);
+    }
+
+    if (menu_hover_changed(menu)) {
+      for (guint i = 0; i < menu->drawn_hover_rows->len; i++) {
+        menu_damage_row(menu, damage,
+                        g_array_index(menu->drawn_hover_rows, int, i),
+                        strip_top, strip_height);
+      }
+      for (guint i = 0; i < menu->hover_rows->len; i++) {
+        menu_damage_row(menu, damage, g_array_index(menu->hover_rows, int, i),
+                        strip_top, strip_height);
+      }
+    }
+
+    // Every row the strip holds, not just the visible ones
+    guint strip_rows = ceil(strip_height / menu->extents.height) + 1;
+    guint first = MAX(strip_top - menu->rows->padding, 0) /
+                  menu->extents.height;
+    guint last =
+        MIN(MAX(row_count, menu->drawn_rows->len), first + strip_rows);
+    for (guint row = first; row < last; row++) {
+      struct app_entry *entry =
+          row < row_count ? menu_row_entry(menu, row) : NULL;
+      struct app_entry *drawn =
+          row < menu->drawn_rows->len ? menu->drawn_rows->pdata[row] : NULL;
+      if (entry != drawn) {
+        menu_damage_row(menu, damage, row, strip_top, strip_height);
+      }
+    }
+  }
+
+  bool moved =
+      menu_scroll_px(menu->y_scroll) != menu_scroll_px(menu->drawn_y_scroll);
+  if (cairo_region_is_empty(damage) && !moved) {
+    cairo_region_destroy(damage);
+    if (menu->kinetic_velocity) {
+      // Moving less than a pixel this frame, but not done yet
+      menu_request_frame(menu);
+    }
+    return;
+  }
+
+#ifdef HAVE_EGL
+  if (menu->egl_surface) {
+    // GL redraws everything, which is cheap with the rows as textures
+    cairo_region_destroy(damage);
+    menu->drawn_strip_top = strip_top;
+    if (!draw_menu_gl(menu, row_count)) {
+      draw_menu(menu);
+    }
+    return;
+  }
+#endif
+
+  if (cairo_region_is_empty(damage)) {
+    // Still within the strip, so nothing needs drawing and the compositor
+    // shows a different part of the buffer it already has
+    cairo_region_destroy(damage);
+    menu->drawn_strip_top = strip_top;
+    menu_frame_drawn(menu, row_count);
+    menu_set_source(menu, menu->width, menu->height);
+    wl_surface_commit(menu->surface);
+    return;
+  }
+
+  // When shifting, the whole buffer changes and is filled in by the worker
+  // instead of by the swapchain
+  cairo_region_t *changed = shift ? cairo_region_create_rectangle(&bounds)
+                                  : cairo_region_copy(damage);
+  struct buffer *front = menu->swapchain.front;
+  TRACE_BEGIN(acquire_start);
+  struct buffer *buffer = swapchain_acquire(&menu->swapchain, changed);
+  TRACE_END(acquire_start, "menu acquire");
+  if (!buffer) {
+    // Try again once the compositor gives a buffer back
+    menu->needs_draw = true;
+    cairo_region_destroy(changed);
+    cairo_region_destroy(damage);
+    return;
+  }
+
+  // What is drawn is recorded now, and committed with the frame callback once
+  // the worker is done
+  start_menu_render(menu, buffer, front, shift, strip_top, row_count, damage,
+                    changed);
+  menu->drawn_strip_top = strip_top;
+  menu_frame_drawn(menu, row_count);
+}
+
+// Rows are measured at scale 1 to size the menu, so that it is the same size
+// on every output. Rows are always drawn with the cache for the menu's scale
+static struct row_cache *layout_rows;
+
+// Sizes the menu to the bounding box of its rows, limited to the size of the
+// output. This includes the rows hidden by the filter, so that typing doesn't
+// resize the surface
+static void menu_configure(struct menu *menu) {
+  struct background *background = menu->background;
+  if (!layout_rows) {
+    layout_rows = row_cache_ref(120);
+  }
+
+  uint32_t width = 0;
+  for (guint i = 0; i < application_list->len; i++) {
+    struct app_entry *entry = application_list->pdata[i];
+    if (!entry->width) {
+      entry->width = row_cache_measure(layout_rows, entry->name);
+    }
+    width = MAX(width, entry->width);
+  }
+  guint rows = frequent_apps->len + application_list->len;
+  uint32_t height =
+      ceil((ceil(rows * menu->extents.height) +
+            menu->rows->padding * 2) /
+           menu->scale);
+
+  width = MAX(MIN(width, background->width), 1);
+  height = MAX(MIN(height, background->height - panel_top()), 1);
+
+  if (width != menu->logical_width || height != menu->logical_height) {
+    menu->logical_width = width;
+    menu->logical_height = height;
+    wp_viewport_set_destination(menu->viewport, width, height);
+
+    // The menu covers everything beneath it, so the compositor doesn't need
+    // to draw or blend the backdrop there
+    struct wl_region *region = wl_compositor_create_region(compositor);
+    wl_region_add(region, 0, 0, width, height);
+    wl_surface_set_opaque_region(menu->surface, region);
+    wl_region_destroy(region);
+  }
+
+  // The buffers are at the native resolution and the viewport scales them
+  // to the surface size
+  uint32_t buffer_width = round(width * menu->scale);
+  uint32_t buffer_height = round(height * menu->scale);
+#ifdef HAVE_EGL
+  if (egl_context != EGL_NO_CONTEXT && !menu->egl_window) {
+    menu->egl_window =
+        wl_egl_window_create(menu->surface, buffer_width, buffer_height);
+    menu->egl_surface = eglCreateWindowSurface(
+        egl_display, egl_config, (EGLNativeWindowType)menu->egl_window, NULL);
+    if (menu->egl_surface == EGL_NO_SURFACE) {
+      fprintf(stderr, "Unable to create EGL surface (0x%x), using wl_shm\n",
+              eglGetError());
+      wl_egl_window_destroy(menu->egl_window);
+      menu->egl_window = NULL;
+    }
+  } else if (menu->egl_window && (buffer_width != menu->width ||
+                                  buffer_height != menu->height)) {
+    wl_egl_window_resize(menu->egl_window, buffer_width, buffer_height, 0, 0);
+    menu->egl_drawn = false;
+  }
+#endif
+  menu->width = buffer_width;
+  menu->height = buffer_height;
+
+  // A menu that scrolls keeps more of the list in its wl_shm buffers than it
+  // shows
+  uint32_t list_height =
+      ceil(rows * menu->extents.height) + menu->rows->padding * 2;
+  menu->strip_height = CLAMP(list_height, buffer_height,
+                             buffer_height * MENU_STRIP_SCREENS);
+
+  draw_menu(menu);
+}
+
+// Picks the scale to draw at from the fractional scale the compositor
+// prefers, or the output scale without it. Returns true if it changed
+static bool menu_update_scale(struct menu *menu) {
+  uint32_t scale_120 = menu->preferred_scale_120;
+  if (!scale_120) {
+    scale_120 = MAX(menu->background->output->scale, 1) * 120;
+  }
+  if (menu->rows && menu->rows->scale_120 == scale_120) {
+    return false;
+  }
+
+  struct row_cache *rows = row_cache_ref(scale_120);
+  if (menu->rows) {
+    // Stay at the same place in the list
+    double ratio = rows->scale / menu->rows->scale;
+    menu->y_scroll *= ratio;
+    menu->pending_scroll *= ratio;
+    menu->kinetic_velocity *= ratio;
+    row_cache_unref(menu->rows);
+  }
+  menu->rows = rows;
+  menu->scale = rows->scale;
+  menu->extents = rows->extents;
+  menu->needs_full_draw = true;
+  return true;
+}
+
+static void menu_preferred_scale(void *data,
+                                 struct wp_fractional_scale_v1 *fractional,
+                                 uint32_t scale) {
+  struct menu *menu = data;
+  menu->preferred_scale_120 = scale;
+  if (menu_update_scale(menu)) {
+    menu_configure(menu);
+  }
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener =
+    {
+        menu_preferred_scale,
+};
+
+// Runs the filter again from scratch, for when the query or the application
+// list changed in a way that the previous matches can't be reused
+static void menu_refilter(struct menu *menu) {
+  if (menu->matches) {
+    g_array_unref(menu->matches);
+    menu->matches = NULL;
+  }
+  if (menu->query->len) {
+    menu->matches = search_apps(menu->folded_query, NULL);
+  }
+}
+
+// Redraws the menu after the application list changed
+static void menu_reload(struct menu *menu) {
+  menu_refilter(menu);
+  menu->needs_full_draw = true;
+  menu_configure(menu);
+}
+
+static void menu_set_query(struct menu *menu, char const *text) {
+  char *folded = fold_text(text);
+  if (menu->matches && *folded &&
+      g_str_has_prefix(folded, menu->folded_query)) {
+    // Typing another character can only narrow the matches down
+    GArray *matches = search_apps(folded, menu->matches);
+    g_array_unref(menu->matches);
+    menu->matches = matches;
+    g_free(menu->folded_query);
+    menu->folded_query = folded;
+    g_string_assign(menu->query, text);
+  } else {
+    g_free(menu->folded_query);
+    menu->folded_query = folded;
+    g_string_assign(menu->query, text);
+    menu_refilter(menu);
+  }
+
+  // Matches are shown from the top
+  menu->y_scroll = 0;
+  draw_menu(menu);
+}
+
+static void menu_key(void *data, struct seat *seat, xkb_keysym_t sym,
+                     char const *text) {
+  struct menu *menu = data;
+  GString *query = g_string_new(menu->query->str);
+
+  switch (sym) {
+  case XKB_KEY_Escape:
+    g_string_truncate(query, 0);
+    break;
+  case XKB_KEY_BackSpace:
+    if (query->len) {
+      char *prev = g_utf8_find_prev_char(query->str, query->str + query->len);
+      g_string_truncate(query, prev ? prev - query->str : 0);
+    }
+    break;
+  case XKB_KEY_Return:
+  case XKB_KEY_KP_Enter: {
+    // Launch the application under the seat's pointer, or the best match
+    int row = menu_seat_row(menu, seat);
+    if (row < 0 && menu_row_count(menu) && menu->query->len) {
+      row = 0;
+    }
+    if (row >= 0) {
+      launch_app(menu_row_entry(menu, row), seat);
+    }
+    break;
+  }
+  default:
+    // Control characters don't go in the query
+    if ((unsigned char)text[0] >= 0x20 && text[0] != 0x7f) {
+      g_string_append(query, text);
+    }
+    break;
+  }
+
+  if (strcmp(query->str, menu->query->str) != 0) {
+    menu_set_query(menu, query->str);
+  }
+  g_string_free(query, TRUE);
+}
+
+static void menu_cursor_motion(void *data, struct seat *seat) {
+  struct menu *menu = data;
+  menu_update(menu);
+}
+
+static void menu_cursor_enter(void *data, struct seat *seat) {
+  struct menu *menu = data;
+  menu_update(menu);
+}
+
+static void menu_cursor_leave(void *data, struct seat *seat) {
+  struct menu *menu = data;
+  menu_update(menu);
+}
+
+// Touchpad scrolling that stops within this many milliseconds of the last
+// movement carries on kinetically
+#define KINETIC_START_MS (50)
+
+static void menu_pointer_scroll(void *data, struct seat *seat,
+                                struct pointer_scroll const *scroll) {
+  struct menu *menu = data;
+  if (!scroll->dy && !scroll->stop) {
+    return;
+  }
+
+  // Any new scrolling takes over from kinetic scrolling
+  menu->kinetic_velocity = 0;
+
+  // Scroll distances are in surface coordinates
+  double dy = scroll->dy * menu->scale;
+
+  if (scroll->source == WL_POINTER_AXIS_SOURCE_FINGER) {
+    if (dy) {
+      uint32_t dt = scroll->time - menu->finger_time;
+      if (dt > 0 && dt < 100) {
+        // Smooth out the jitter between events
+        menu->finger_velocity = 0.6 * (dy / dt) + 0.4 * menu->finger_velocity;
+      } else {
+        menu->finger_velocity = 0;
+      }
+      menu->finger_time = scroll->time;
+    }
+
+    if (scroll->stop) {
+      if (scroll->time - menu->finger_time < KINETIC_START_MS &&
+          fabs(menu->finger_velocity) >= KINETIC_MIN_VELOCITY) {
+        menu->kinetic_velocity = menu->finger_velocity;
+        menu->kinetic_time = 0;
+        menu_request_frame(menu);
+      }
+      menu->finger_velocity = 0;
+    }
+  }
+
+  menu->pending_scroll += dy;
+  menu_update(menu);
+}
+
+static void menu_pointer_button(void *data, struct seat *seat,
+                                uint32_t button, uint32_t state) {
+  struct menu *menu = data;
+  if (button == BTN_LEFT && state == WL_POINTER_BUTTON_STATE_RELEASED) {
+    int row = menu_seat_row(menu, seat);
+    if (row >= 0) {
+      launch_app(menu_row_entry(menu, row), seat);
+    }
+  }
+}
+
+static struct menu *create_menu(struct background *background) {
+  struct menu *m = calloc(1, sizeof(*m));
+  m->background = background;
+  m->pool = calloc(1, sizeof(*m->pool));
+  init_shm_pool(m->pool);
+  init_swapchain(&m->swapchain, m->pool, WL_SHM_FORMAT_XRGB8888,
+                 menu_buffer_released, m);
+
+  m->surface = wl_compositor_create_surface(compositor);
+  wl_surface_add_listener(m->surface, &desktop_surface_listener, m);
+  m->subsurface = wl_subcompositor_get_subsurface(subcompositor, m->surface,
+                                                  background->surface);
+  wl_subsurface_set_position(m->subsurface, 0, panel_top());
+  wl_subsurface_set_desync(m->subsurface);
+  m->viewport = wp_viewporter_get_viewport(viewporter, m->surface);
+  if (fractional_scale_manager) {
+    m->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
+        fractional_scale_manager, m->surface);
+    wp_fractional_scale_v1_add_listener(m->fractional_scale,
+                                        &fractional_scale_listener, m);
+  }
+
+  m->base.cursor = "left_ptr";
+  m->base.output = background->output;
+  m->hover_rows = g_array_new(FALSE, FALSE, sizeof(int));
+  m->drawn_hover_rows = g_array_new(FALSE, FALSE, sizeof(int));
+  menu_update_scale(m);
+  m->base.on_cursor_motion = menu_cursor_motion;
+  m->base.on_cursor_enter = menu_cursor_enter;
+  m->base.on_cursor_leave = menu_cursor_leave;
+  m->base.on_pointer_scroll = menu_pointer_scroll;
+  m->base.on_pointer_button = menu_pointer_button;
+  m->query = g_string_new(NULL);
+  m->folded_query = g_strdup("");
+  m->drawn_rows = g_ptr_array_new();
+
+  return m;
+}
+
+static void destroy_menu(struct menu *menu) {
+  if (menu->frame) {
+    wl_callback_destroy(menu->frame);
+  }
+  if (menu->fractional_scale) {
+    wp_fractional_scale_v1_destroy(menu->fractional_scale);
+  }
+  wp_viewport_destroy(menu->viewport);
+#ifdef HAVE_EGL
+  if (menu->egl_surface) {
+    menu_finish_egl(menu);
+  }
+#endif
+  wl_subsurface_destroy(menu->subsurface);
+  wl_surface_destroy(menu->surface);
+  finish_swapchain(&menu->swapchain);
+  if (menu->render) {
+    // The worker is still drawing into the pool, which goes with it
+    menu->render->menu = NULL;
+  } else {
+    finish_shm_pool(menu->pool);
+    free(menu->pool);
+  }
+  row_cache_unref(menu->rows);
+
+  g_string_free(menu->query, TRUE);
+  g_free(menu->folded_query);
+  if (menu->matches) {
+    g_array_unref(menu->matches);
+  }
+  g_ptr_array_free(menu->drawn_rows, TRUE);
+  g_array_unref(menu->hover_rows);
+  g_array_unref(menu->drawn_hover_rows);
+  free(menu);
+}
+
+// Panel
+//
+// A strip along the top or bottom of each output with shortcuts to the
+// panel-launchers applications on the left and the battery status and the
+// clock on the right. Each widget is redrawn only when it changes, and the
+// clock and status are refreshed by one timer that fires on minute boundaries
+struct panel_widget {
+  // Horizontal extent in surface coordinates
+  int x;
+  int width;
+  // Owned text shown by the widget
+  char *text;
+  // Application started by clicking the widget, or NULL
+  struct app_entry *app;
+  bool dirty;
+};
+
+struct panel {
+  struct desktop_surface base;
+  struct output *output;
+  struct wl_surface *surface;
+  struct swapchain swapchain;
+  int32_t scale;
+  // Surface width, the height is always PANEL_HEIGHT
+  uint32_t width;
+  bool needs_draw;
+  // The launchers, then the status and the clock
+  struct panel_widget *widgets;
+  guint n_widgets;
+  // Widget under a pointer, or -1
+  int hover;
+};
+
+// The applications of the panel-launchers, shared by every panel
+static GPtrArray *panel_launchers;
+// Wall clock timer for the minute changing, and what watches it
+static int panel_clock_fd = -1;
+static guint panel_clock_source;
+static GFileMonitor *panel_timezone_monitor;
+
+#define PANEL_STATUS(panel) (&(panel)->widgets[(panel)->n_widgets - 2])
+#define PANEL_CLOCK(panel) (&(panel)->widgets[(panel)->n_widgets - 1])
+
+static void set_panel_font(cairo_t *cr, double scale) {
+  cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL,
+                         CAIRO_FONT_WEIGHT_NORMAL);
+  cairo_set_font_size(cr, PANEL_FONT_SIZE * scale);
+}
+
+// Returns the widths of texts at scale 1 in surface coordinates
+static int panel_text_width(char const *text) {
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+  cairo_t *cr = cairo_create(surface);
+  set_panel_font(cr, 1);
+  cairo_text_extents_t extents;
+  cairo_text_extents(cr, text, &extents);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  return ceil(extents.x_advance) + PANEL_PADDING * 2;
+}
+
+static void load_panel_launchers(void) {
+  panel_launchers = g_ptr_array_new();
+  for (char **id = config.panel_launchers; id && *id; id++) {
+    GDesktopAppInfo *info = g_desktop_app_info_new(*id);
+    if (!info) {
+      fprintf(stderr, "Panel launcher '%s' not found\n", *id);
+      continue;
+    }
+    g_ptr_array_add(panel_launchers, app_entry_from_info(G_APP_INFO(info)));
+    g_object_unref(info);
+  }
+}
+
+// Returns the charge of the first battery as text, or an empty string
+static char *read_battery_status(void) {
+  char *status = NULL;
+  glob_t paths;
+  if (glob("/sys/class/power_supply/*/capacity", 0, NULL, &paths) == 0) {
+    for (size_t i = 0; i < paths.gl_pathc && !status; i++) {
+      char *dir = g_path_get_dirname(paths.gl_pathv[i]);
+      char *type_path = g_build_filename(dir, "type", NULL);
+      char *type = NULL;
+      char *capacity = NULL;
+      if (g_file_get_contents(type_path, &type, NULL, NULL) &&
+          g_str_has_prefix(type, "Battery") &&
+          g_file_get_contents(paths.gl_pathv[i], &capacity, NULL, NULL)) {
+        status = g_strdup_printf("%d%%", atoi(capacity));
+      }
+      g_free(capacity);
+      g_free(type);
+      g_free(type_path);
+      g_free(dir);
+    }
+    globfree(&paths);
+  }
+  return status ? status : g_strdup("");
+}
+
+// GLib caches the local time zone for good, so the C library is asked
+// instead. tzset() reloads it if /etc/localtime changed
+static char *format_clock(void) {
+  time_t now = time(NULL);
+  struct tm tm;
+  char text[16];
+  tzset();
+  if (!localtime_r(&now, &tm) || !strftime(text, sizeof(text), "%H:%M", &tm)) {
+    return g_strdup("");
+  }
+  return g_strdup(text);
+}
+
+// Shows text on a widget, marking it dirty only if it changed
+static void panel_widget_set_text(struct panel_widget *widget, char *text) {
+  if (widget->text && strcmp(widget->text, text) == 0) {
+    g_free(text);
+    return;
+  }
+  g_free(widget->text);
+  widget->text = text;
+  widget->dirty = true;
+}
+
+// Places the launchers from the left and the clock and status from the right
+static void panel_layout(struct panel *panel) {
+  int x = 0;
+  for (guint i = 0; i < panel->n_widgets - 2; i++) {
+    struct panel_widget *widget = &panel->widgets[i];
+    widget->x = x;
+    widget->width = panel_text_width(widget->text);
+    x += widget->width;
+  }
+
+  // Wide enough for any time or charge, so they never move
+  struct panel_widget *clock = PANEL_CLOCK(panel);
+  clock->width = panel_text_width("00:00");
+  clock->x = panel->width - clock->width;
+  struct panel_widget *status = PANEL_STATUS(panel);
+  status->width = panel_text_width("100%");
+  status->x = clock->x - status->width;
+}
+
+static void draw_panel(struct panel *panel) {
+  panel->needs_draw = false;
+  int32_t scale = panel->scale;
+  uint32_t width = panel->width * scale;
+  uint32_t height = PANEL_HEIGHT * scale;
+  uint32_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+  swapchain_resize(&panel->swapchain, width, height, stride);
+
+  cairo_region_t *damage = cairo_region_create();
+  for (guint i = 0; i < panel->n_widgets; i++) {
+    struct panel_widget *widget = &panel->widgets[i];
+    if (widget->dirty || !panel->swapchain.front) {
+      cairo_rectangle_int_t rect = {widget->x * scale, 0, widget->width * scale,
+                                    height};
+      cairo_region_union_rectangle(damage, &rect);
+    }
+  }
+  if (!panel->swapchain.front) {
+    cairo_rectangle_int_t rect = {0, 0, width, height};
+    cairo_region_union_rectangle(damage, &rect);
+  }
+  if (cairo_region_is_empty(damage)) {
+    cairo_region_destroy(damage);
+    return;
+  }
+
+  TRACE_BEGIN(start);
+  struct buffer *buffer = swapchain_acquire(&panel->swapchain, damage);
+  if (!buffer) {
+    panel->needs_draw = true;
+    cairo_region_destroy(damage);
+    return;
+  }
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      buffer_data(buffer), CAIRO_FORMAT_RGB24, width, height, stride);
+  cairo_t *cr = cairo_create(surface);
+  int num_rects = cairo_region_num_rectangles(damage);
+  for (int i = 0; i < num_rects; i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(damage, i, &rect);
+    cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_clip(cr);
+
+  cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
+  cairo_paint(cr);
+
+  set_panel_font(cr, scale);
+  cairo_font_extents_t extents;
+  cairo_font_extents(cr, &extents);
+  double baseline = (height - extents.height) / 2 + extents.ascent;
+  for (guint i = 0; i < panel->n_widgets; i++) {
+    struct panel_widget *widget = &panel->widgets[i];
+    if ((int)i == panel->hover) {
+      cairo_set_source_rgb(cr, 0, 1, 1);
+    } else {
+      cairo_set_source_rgb(cr, 1, 1, 1);
+    }
+    cairo_move_to(cr, (widget->x + PANEL_PADDING) * scale, baseline);
+    cairo_show_text(cr, widget->text);
+    widget->dirty = false;
+  }
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+
+  swapchain_present(&panel->swapchain, buffer, panel->surface, damage);
+  cairo_region_destroy(damage);
+  wl_surface_set_buffer_scale(panel->surface, scale);
+  wl_surface_commit(panel->surface);
+  TRACE_END(start, "draw_panel");
+}
+
+static void panel_buffer_released(void *data) {
+  struct panel *panel = data;
+  if (panel->needs_draw) {
+    draw_panel(panel);
+  }
+}
+
+static void panel_configure(void *data,
+                            struct weston_desktop_shell *weston_desktop_shell,
+                            uint32_t edges, struct wl_surface *surface,
+                            int32_t width, int32_t height) {
+  struct panel *panel = data;
+  if (panel->width == (uint32_t)width && panel->swapchain.front) {
+    return;
+  }
+  panel->width = width;
+  panel_layout(panel);
+  draw_panel(panel);
+}
+
+// Redraws the panel at the output's scale if that changed
+static void panel_update_scale(struct panel *panel) {
+  int32_t scale = MAX(panel->output->scale, 1);
+  if (scale != panel->scale) {
+    panel->scale = scale;
+    if (panel->width) {
+      draw_panel(panel);
+    }
+  }
+}
+
+static int panel_widget_at(struct panel *panel, double x) {
+  for (guint i = 0; i < panel->n_widgets; i++) {
+    struct panel_widget *widget = &panel->widgets[i];
+    if (widget->app && x >= widget->x && x < widget->x + widget->width) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Highlights the launcher under any pointer on the panel
+static void panel_update_hover(struct panel *panel) {
+  int hover = -1;
+  struct seat *seat;
+  wl_list_for_each(seat, &seat_list, link) {
+    if (seat->pointer.surface == &panel->base && hover < 0) {
+      hover = panel_widget_at(panel, seat->pointer.x);
+    }
+  }
+  if (hover == panel->hover) {
+    return;
+  }
+  if (panel->hover >= 0) {
+    panel->widgets[panel->hover].dirty = true;
+  }
+  if (hover >= 0) {
+    panel->widgets[hover].dirty = true;
+  }
+  panel->hover = hover;
+  draw_panel(panel);
+}
+
+static void panel_cursor_changed(void *data, struct seat *seat) {
+  panel_update_hover(data);
+}
+
+static void panel_pointer_button(void *data, struct seat *seat,
+                                 uint32_t button, uint32_t state) {
+  struct panel *panel = data;
+  if (button == BTN_LEFT && state == WL_POINTER_BUTTON_STATE_RELEASED) {
+    int widget = panel_widget_at(panel, seat->pointer.x);
+    if (widget >= 0) {
+      launch_app(panel->widgets[widget].app, seat);
+    }
+  }
+}
+
+// Refreshes the clock and status of every panel
+static void update_panels(void) {
+  char *clock = format_clock();
+  char *status = read_battery_status();
+  struct output *output;
+  wl_list_for_each(output, &output_list, link) {
+    struct panel *panel = output->panel;
+    if (panel) {
+      panel_widget_set_text(PANEL_CLOCK(panel), g_strdup(clock));
+      panel_widget_set_text(PANEL_STATUS(panel), g_strdup(status));
+      if (panel->width) {
+        draw_panel(panel);
+      }
+    }
+  }
+  g_free(status);
+  g_free(clock);
+}
+
+// Wakes up just after the next minute starts instead of polling every second.
+// The timer is absolute on the wall clock, so it still fires on the minute
+// after a suspend, and setting the clock cancels it so the panels catch up
+// straight away
+static void schedule_panel_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  struct itimerspec next = {
+      .it_value = {.tv_sec = now.tv_sec - now.tv_sec % 60 + 60,
+                   .tv_nsec = 10000000},
+  };
+  if (timerfd_settime(panel_clock_fd,
+                      TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &next,
+                      NULL) < 0) {
+    perror("Unable to set clock timer");
+  }
+}
+
+static gboolean panel_clock_tick(gint fd, GIOCondition condition,
+                                 gpointer data) {
+  // Fails with ECANCELED when the clock was set, which needs the same update
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN) {
+    return G_SOURCE_CONTINUE;
+  }
+  update_panels();
+  schedule_panel_clock();
+  return G_SOURCE_CONTINUE;
+}
+
+static void panel_timezone_changed(GFileMonitor *monitor, GFile *file,
+                                   GFile *other, GFileMonitorEvent event,
+                                   gpointer data) {
+  update_panels();
+}
+
+static void start_panel_clock(void) {
+  panel_clock_fd =
+      timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (panel_clock_fd < 0) {
+    perror("Unable to create clock timer");
+    return;
+  }
+  schedule_panel_clock();
+  panel_clock_source =
+      g_unix_fd_add(panel_clock_fd, G_IO_IN, panel_clock_tick, NULL);
+
+  // Changing the time zone replaces /etc/localtime without setting the clock
+  GFile *localtime = g_file_new_for_path("/etc/localtime");
+  panel_timezone_monitor =
+      g_file_monitor_file(localtime, G_FILE_MONITOR_NONE, NULL, NULL);
+  g_object_unref(localtime);
+  if (panel_timezone_monitor) {
+    g_signal_connect(panel_timezone_monitor, "changed",
+                     G_CALLBACK(panel_timezone_changed), NULL);
+  }
+}
+
+static void stop_panel_clock(void) {
+  if (panel_clock_source) {
+    g_source_remove(panel_clock_source);
+    panel_clock_source = 0;
+  }
+  if (panel_clock_fd >= 0) {
+    close(panel_clock_fd);
+    panel_clock_fd = -1;
+  }
+  g_clear_object(&panel_timezone_monitor);
+}
+
+static struct panel *create_panel(struct output *output) {
+  struct panel *p = calloc(1, sizeof(*p));
+  p->output = output;
+  p->scale = MAX(output->scale, 1);
+  p->hover = -1;
+  init_swapchain(&p->swapchain, &output->pool, WL_SHM_FORMAT_XRGB8888,
+                 panel_buffer_released, p);
+
+  p->n_widgets = panel_launchers->len + 2;
+  p->widgets = calloc(p->n_widgets, sizeof(*p->widgets));
+  for (guint i = 0; i < panel_launchers->len; i++) {
+    struct app_entry *entry = panel_launchers->pdata[i];
+    p->widgets[i].app = entry;
+    p->widgets[i].text = g_strdup(entry->name);
+  }
+  PANEL_CLOCK(p)->text = format_clock();
+  PANEL_STATUS(p)->text = read_battery_status();
+
+  p->surface = wl_compositor_create_surface(compositor);
+  wl_surface_add_listener(p->surface, &desktop_surface_listener, p);
+  p->base.configure = panel_configure;
+  p->base.cursor = "left_ptr";
+  p->base.output = output;
+  p->base.on_cursor_enter = panel_cursor_changed;
+  p->base.on_cursor_motion = panel_cursor_changed;
+  p->base.on_cursor_leave = panel_cursor_changed;
+  p->base.on_pointer_button = panel_pointer_button;
+
+  weston_desktop_shell_set_panel(desktop_shell, output->output, p->surface);
+  if (panel_clock_fd < 0) {
+    start_panel_clock();
+  }
+  return p;
+}
+
+static void destroy_panel(struct panel *panel) {
+  wl_surface_destroy(panel->surface);
+  finish_swapchain(&panel->swapchain);
+  for (guint i = 0; i < panel->n_widgets; i++) {
+    g_free(panel->widgets[i].text);
+  }
+  free(panel->widgets);
+  free(panel);
+}
+
+// Output
+static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
+                            int32_t y, int32_t physical_width,
                             int32_t physical_height, int32_t subpixel,
                             const char *make, const char *model,
                             int32_t transform) {}
 
-static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
-                        int32_t width, int32_t height, int32_t refresh) {
-  struct output *output = data;
-  if (flags & WL_OUTPUT_MODE_CURRENT) {
-    output->width = width;
-    output->height = height;
+static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+                        int32_t width, int32_t height, int32_t refresh) {
+  struct output *output = data;
+  if (flags & WL_OUTPUT_MODE_CURRENT) {
+    output->width = width;
+    output->height = height;
+  }
+}
+
+static void output_done(void *data, struct wl_output *wl_output) {
+  struct output *output = data;
+  if (!output->background) {
+    struct background *b = calloc(1, sizeof(*output->background));
+    output->background = b;
+    b->output = output;
+    init_swapchain(&b->swapchain, &output->pool, WL_SHM_FORMAT_XRGB8888,
+                   background_buffer_released, b);
+
+    b->surface = wl_compositor_create_surface(compositor);
+    wl_surface_add_listener(b->surface, &desktop_surface_listener, b);
+    b->viewport = wp_viewporter_get_viewport(viewporter, b->surface);
+    b->base.configure = background_configure;
+    b->base.cursor = "left_ptr";
+    b->base.output = output;
+    b->base.on_pointer_scroll = background_pointer_scroll;
+    b->base.on_pointer_button = background_pointer_button;
+
+    b->menu = create_menu(b);
+
+    weston_desktop_shell_set_background(desktop_shell, output->output,
+                                        b->surface);
+
+    if (config.panel_position != PANEL_POSITION_NONE) {
+      output->panel = create_panel(output);
+    }
+  } else {
+    if (menu_update_scale(output->background->menu)) {
+      menu_configure(output->background->menu);
+    }
+    if (output->panel) {
+      panel_update_scale(output->panel);
+    }
+  }
+}
+
+static void output_scale(void *data, struct wl_output *wl_output,
+                         int32_t factor) {
+  struct output *output = data;
+  output->scale = factor;
+}
+
+static void output_name(void *data, struct wl_output *wl_output,
+                        const char *name) {}
+
+static void output_description(void *data, struct wl_output *wl_output,
+                               const char *description) {}
+
+static const struct wl_output_listener output_listener = {
+    output_geometry, output_mode, output_done,
+    output_scale,    output_name, output_description,
+};
+
+// XDG WM base
+static void xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base,
+                             uint32_t serial) {
+  xdg_wm_base_pong(xdg_wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener xdg_wm_base_listener = {
+    xdg_wm_base_ping,
+};
+
+// Idle
+//
+// After idle-timeout seconds without input the shell drops everything it can
+// rebuild on demand: spare buffers, rendered rows and the search index. It
+// also cancels the timers and frame callbacks it would otherwise keep, so it
+// only wakes up for the next input or the panel clock. Input is noted with a
+// timestamp rather than by resetting a timer on every event
+static guint idle_source;
+static gint64 last_activity;
+
+static void keyboard_stop_repeat(struct seat *seat);
+
+#ifdef HAVE_EGL
+// Deletes the textures of the rows that were just dropped, on the surface of
+// any menu drawn with GL, rather than waiting for the next frame
+static void release_dead_textures(void) {
+  struct output *output;
+  wl_list_for_each(output, &output_list, link) {
+    struct menu *menu = output->background ? output->background->menu : NULL;
+    if (menu && menu->egl_surface) {
+      eglMakeCurrent(egl_display, menu->egl_surface, menu->egl_surface,
+                     egl_context);
+      delete_dead_textures();
+      return;
+    }
+  }
+}
+#endif
+
+static void enter_idle(void) {
+  struct seat *seat;
+  wl_list_for_each(seat, &seat_list, link) {
+    keyboard_stop_repeat(seat);
+    cursor_stop_animation(seat);
+  }
+
+  struct output *output;
+  wl_list_for_each(output, &output_list, link) {
+    struct background *background = output->background;
+    if (background) {
+      swapchain_trim(&background->swapchain);
+
+      struct menu *menu = background->menu;
+      menu->kinetic_velocity = 0;
+      menu->finger_velocity = 0;
+      if (menu->frame && !menu->needs_draw) {
+        wl_callback_destroy(menu->frame);
+        menu->frame = NULL;
+      }
+      swapchain_trim(&menu->swapchain);
+      shm_pool_trim(menu->pool);
+    }
+    if (output->panel) {
+      swapchain_trim(&output->panel->swapchain);
+    }
+    shm_pool_trim(&output->pool);
+  }
+
+  struct row_cache *cache;
+  wl_list_for_each(cache, &row_caches, link) {
+    g_hash_table_remove_all(cache->rows);
+  }
+  search_index_invalidate();
+#ifdef HAVE_EGL
+  release_dead_textures();
+#endif
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+
+  launcher_helper_preload_frequent();
+  flush_launch_records();
+  flush_usage();
+}
+
+static gboolean idle_check(gpointer data) {
+  gint64 elapsed = (g_get_monotonic_time() - last_activity) / 1000;
+  gint64 timeout = config.idle_timeout * (gint64)1000;
+  if (elapsed < timeout) {
+    idle_source = g_timeout_add(timeout - elapsed, idle_check, NULL);
+  } else {
+    idle_source = 0;
+    enter_idle();
+  }
+  return G_SOURCE_REMOVE;
+}
+
+// Called for every input event
+static void note_activity(void) {
+  last_activity = g_get_monotonic_time();
+  if (!idle_source && config.idle_timeout > 0) {
+    idle_source = g_timeout_add_seconds(config.idle_timeout, idle_check, NULL);
+  }
+}
+
+// Pointer
+static void pointer_enter(void *data, struct wl_pointer *wl_pointer,
+                          uint32_t serial, struct wl_surface *surface,
+                          wl_fixed_t surface_x, wl_fixed_t surface_y) {
+  struct seat *seat = data;
+  note_activity();
+  // NULL if the surface was destroyed while the event was on its way, which
+  // happens when outputs or the search window go away
+  struct desktop_surface *s =
+      surface ? wl_surface_get_user_data(surface) : NULL;
+  if (!s) {
+    return;
+  }
+
+  seat->pointer.surface = s;
+  if (s->cursor) {
+    set_cursor(seat, s, serial);
+  }
+  seat->pointer.x = wl_fixed_to_double(surface_x);
+  seat->pointer.y = wl_fixed_to_double(surface_y);
+  if (s->on_cursor_enter) {
+    s->on_cursor_enter(s, seat);
+  }
+}
+
+static void pointer_leave(void *data, struct wl_pointer *wl_pointer,
+                          uint32_t serial, struct wl_surface *surface) {
+  struct seat *seat = data;
+  struct desktop_surface *s =
+      surface ? wl_surface_get_user_data(surface) : NULL;
+  // Whatever is shown next sets its own cursor
+  cursor_stop_animation(seat);
+  // Cleared first so the surface no longer counts this seat as hovering
+  seat->pointer.surface = NULL;
+  seat->pointer.x = -1;
+  seat->pointer.y = -1;
+  if (s && s->on_cursor_leave) {
+    s->on_cursor_leave(s, seat);
+  }
+}
+
+static void pointer_motion(void *data, struct wl_pointer *wl_pointer,
+                           uint32_t time, wl_fixed_t surface_x,
+                           wl_fixed_t surface_y) {
+  struct seat *seat = data;
+  note_activity();
+  struct desktop_surface *s = seat->pointer.surface;
+  if (s) {
+    if (s->cursor) {
+      cursor_resume_animation(seat);
+    }
+    seat->pointer.x = wl_fixed_to_double(surface_x);
+    seat->pointer.y = wl_fixed_to_double(surface_y);
+    if (s->on_cursor_motion) {
+      s->on_cursor_motion(s, seat);
+    }
+  }
+}
+
+static void pointer_button(void *data, struct wl_pointer *wl_pointer,
+                           uint32_t serial, uint32_t time, uint32_t button,
+                           uint32_t state) {
+  struct seat *seat = data;
+  note_activity();
+  seat->serial = serial;
+  struct desktop_surface *s = seat->pointer.surface;
+  if (s && s->on_pointer_button) {
+    s->on_pointer_button(s, seat, button, state);
+  }
+}
+
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer);
+
+// Axis events are collected until the frame that ends them, so that a
+// diagonal or multi-axis scroll is handled once
+static void pointer_scroll_changed(struct seat *seat) {
+  seat->pointer.has_scroll = true;
+  // Compositors before version 5 don't send frames
+  if (wl_pointer_get_version(seat->pointer.pointer) <
+      WL_POINTER_FRAME_SINCE_VERSION) {
+    pointer_frame(seat, seat->pointer.pointer);
+  }
+}
+
+static void pointer_axis(void *data, struct wl_pointer *wl_pointer,
+                         uint32_t time, uint32_t axis, wl_fixed_t value) {
+  struct seat *seat = data;
+  note_activity();
+  seat->pointer.scroll.time = time;
+  if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
+    seat->pointer.scroll.dy += wl_fixed_to_double(value);
+  } else {
+    seat->pointer.scroll.dx += wl_fixed_to_double(value);
+  }
+  pointer_scroll_changed(seat);
+}
+
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer) {
+  struct seat *seat = data;
+  struct desktop_surface *s = seat->pointer.surface;
+  if (seat->pointer.has_scroll) {
+    if (s && s->on_pointer_scroll) {
+      s->on_pointer_scroll(s, seat, &seat->pointer.scroll);
+    }
+    seat->pointer.scroll = (struct pointer_scroll){.source = -1};
+    seat->pointer.has_scroll = false;
+  }
+  if (s && s->on_pointer_frame) {
+    s->on_pointer_frame(s, seat);
+  }
+}
+
+static void pointer_axis_source(void *data, struct wl_pointer *wl_pointer,
+                                uint32_t axis_source) {
+  struct seat *seat = data;
+  seat->pointer.scroll.source = axis_source;
+}
+
+static void pointer_axis_stop(void *data, struct wl_pointer *wl_pointer,
+                              uint32_t time, uint32_t axis) {
+  struct seat *seat = data;
+  if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
+    seat->pointer.scroll.time = time;
+    seat->pointer.scroll.stop = true;
+    pointer_scroll_changed(seat);
+  }
+}
+
+// The axis event sent alongside has the distance in pixels, which is all the
+// menu needs
+static void pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer,
+                                  uint32_t axis, int32_t discrete) {}
+
+static const struct wl_pointer_listener pointer_listener = {
+    pointer_enter,       pointer_leave,     pointer_motion,
+    pointer_button,      pointer_axis,      pointer_frame,
+    pointer_axis_source, pointer_axis_stop, pointer_axis_discrete,
+};
+
+// Keyboard
+static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
+                            uint32_t format, int32_t fd, uint32_t size) {
+  struct seat *seat = data;
+  if (format != WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1) {
+    close(fd);
+    return;
+  }
+
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("Unable to map keymap");
+    return;
+  }
+
+  struct xkb_keymap *keymap = xkb_keymap_new_from_string(
+      xkb_context, map, XKB_KEYMAP_FORMAT_TEXT_V1, XKB_KEYMAP_COMPILE_NO_FLAGS);
+  munmap(map, size);
+  if (!keymap) {
+    fprintf(stderr, "Unable to compile keymap\n");
+    return;
+  }
+
+  if (seat->keyboard.state) {
+    xkb_state_unref(seat->keyboard.state);
+    xkb_keymap_unref(seat->keyboard.keymap);
+  }
+  seat->keyboard.keymap = keymap;
+  seat->keyboard.state = xkb_state_new(keymap);
+}
+
+static void keyboard_stop_repeat(struct seat *seat) {
+  if (seat->keyboard.repeat_source) {
+    g_source_remove(seat->keyboard.repeat_source);
+    seat->keyboard.repeat_source = 0;
+  }
+}
+
+static void keyboard_send_key(struct seat *seat, uint32_t key) {
+  struct desktop_surface *s = seat->keyboard.surface;
+  if (!s || !s->on_key || !seat->keyboard.state) {
+    return;
+  }
+
+  // evdev codes are offset by 8 from XKB keycodes
+  xkb_keysym_t sym = xkb_state_key_get_one_sym(seat->keyboard.state, key + 8);
+  char text[16];
+  xkb_state_key_get_utf8(seat->keyboard.state, key + 8, text, sizeof(text));
+  s->on_key(s, seat, sym, text);
+}
+
+static gboolean keyboard_repeat(gpointer data) {
+  struct seat *seat = data;
+  keyboard_send_key(seat, seat->keyboard.repeat_key);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean keyboard_repeat_delay(gpointer data) {
+  struct seat *seat = data;
+  keyboard_send_key(seat, seat->keyboard.repeat_key);
+  seat->keyboard.repeat_source =
+      g_timeout_add(1000 / seat->keyboard.repeat_rate, keyboard_repeat, seat);
+  return G_SOURCE_REMOVE;
+}
+
+static void keyboard_enter(void *data, struct wl_keyboard *wl_keyboard,
+                           uint32_t serial, struct wl_surface *surface,
+                           struct wl_array *keys) {
+  struct seat *seat = data;
+  // As in pointer_enter, the surface may already be gone
+  seat->keyboard.surface = surface ? wl_surface_get_user_data(surface) : NULL;
+}
+
+static void keyboard_leave(void *data, struct wl_keyboard *wl_keyboard,
+                           uint32_t serial, struct wl_surface *surface) {
+  struct seat *seat = data;
+  struct desktop_surface *s = seat->keyboard.surface;
+  keyboard_stop_repeat(seat);
+  seat->keyboard.surface = NULL;
+  if (s && s->on_keyboard_leave) {
+    s->on_keyboard_leave(s, seat);
+  }
+}
+
+static void keyboard_key(void *data, struct wl_keyboard *wl_keyboard,
+                         uint32_t serial, uint32_t time, uint32_t key,
+                         uint32_t state) {
+  struct seat *seat = data;
+  note_activity();
+  if (state != WL_KEYBOARD_KEY_STATE_PRESSED) {
+    if (key == seat->keyboard.repeat_key) {
+      keyboard_stop_repeat(seat);
+    }
+    return;
+  }
+
+  seat->serial = serial;
+  keyboard_stop_repeat(seat);
+  keyboard_send_key(seat, key);
+
+  if (seat->keyboard.keymap && seat->keyboard.repeat_rate > 0 &&
+      xkb_keymap_key_repeats(seat->keyboard.keymap, key + 8)) {
+    seat->keyboard.repeat_key = key;
+    seat->keyboard.repeat_source = g_timeout_add(
+        seat->keyboard.repeat_delay, keyboard_repeat_delay, seat);
+  }
+}
+
+static void keyboard_modifiers(void *data, struct wl_keyboard *wl_keyboard,
+                               uint32_t serial, uint32_t mods_depressed,
+                               uint32_t mods_latched, uint32_t mods_locked,
+                               uint32_t group) {
+  struct seat *seat = data;
+  if (seat->keyboard.state) {
+    xkb_state_update_mask(seat->keyboard.state, mods_depressed, mods_latched,
+                          mods_locked, 0, 0, group);
+  }
+}
+
+static void keyboard_repeat_info(void *data, struct wl_keyboard *wl_keyboard,
+                                 int32_t rate, int32_t delay) {
+  struct seat *seat = data;
+  seat->keyboard.repeat_rate = rate;
+  seat->keyboard.repeat_delay = delay;
+}
+
+static const struct wl_keyboard_listener keyboard_listener = {
+    keyboard_keymap, keyboard_enter,     keyboard_leave,
+    keyboard_key,    keyboard_modifiers, keyboard_repeat_info,
+};
+
+// seat
+static void seat_release_pointer(struct seat *seat) {
+  struct desktop_surface *surface = seat->pointer.surface;
+  seat->pointer.surface = NULL;
+  if (surface && surface->on_cursor_leave) {
+    // Drop this seat's hover highlight
+    surface->on_cursor_leave(surface, seat);
+  }
+  cursor_stop_animation(seat);
+  if (seat->pointer.cursor_surface) {
+    wl_surface_destroy(seat->pointer.cursor_surface);
+    seat->pointer.cursor_surface = NULL;
+    seat->pointer.cursor = NULL;
+  }
+
+  if (wl_pointer_get_version(seat->pointer.pointer) >=
+      WL_POINTER_RELEASE_SINCE_VERSION) {
+    wl_pointer_release(seat->pointer.pointer);
+  } else {
+    wl_pointer_destroy(seat->pointer.pointer);
+  }
+  seat->pointer.pointer = NULL;
+}
+
+static void seat_release_keyboard(struct seat *seat) {
+  keyboard_stop_repeat(seat);
+  if (wl_keyboard_get_version(seat->keyboard.keyboard) >=
+      WL_KEYBOARD_RELEASE_SINCE_VERSION) {
+    wl_keyboard_release(seat->keyboard.keyboard);
+  } else {
+    wl_keyboard_destroy(seat->keyboard.keyboard);
+  }
+  seat->keyboard.keyboard = NULL;
+  seat->keyboard.surface = NULL;
+  if (seat->keyboard.state) {
+    xkb_state_unref(seat->keyboard.state);
+    xkb_keymap_unref(seat->keyboard.keymap);
+    seat->keyboard.state = NULL;
+    seat->keyboard.keymap = NULL;
+  }
+}
+
+static void seat_capabilities(void *data, struct wl_seat *wl_seat,
+                              uint32_t capabilities) {
+  struct seat *seat = data;
+  if ((capabilities & WL_SEAT_CAPABILITY_POINTER) && !seat->pointer.pointer) {
+    seat->pointer.pointer = wl_seat_get_pointer(seat->seat);
+    seat->pointer.surface = NULL;
+    seat->pointer.x = -1;
+    seat->pointer.y = -1;
+    seat->pointer.scroll.source = -1;
+    wl_pointer_add_listener(seat->pointer.pointer, &pointer_listener, seat);
+  }
+
+  if ((capabilities & WL_SEAT_CAPABILITY_KEYBOARD) &&
+      !seat->keyboard.keyboard) {
+    seat->keyboard.keyboard = wl_seat_get_keyboard(seat->seat);
+    // Used until the compositor sends repeat_info
+    seat->keyboard.repeat_rate = 25;
+    seat->keyboard.repeat_delay = 600;
+    wl_keyboard_add_listener(seat->keyboard.keyboard, &keyboard_listener,
+                             seat);
+  }
+
+  if (!(capabilities & WL_SEAT_CAPABILITY_POINTER) && seat->pointer.pointer) {
+    seat_release_pointer(seat);
+  }
+  if (!(capabilities & WL_SEAT_CAPABILITY_KEYBOARD) &&
+      seat->keyboard.keyboard) {
+    seat_release_keyboard(seat);
+  }
+}
+
+static void seat_name(void *data, struct wl_seat *wl_seat, const char *name) {}
+
+static const struct wl_seat_listener seat_listener = {
+    seat_capabilities,
+    seat_name,
+};
+
+// Removal
+//
+// Everything belonging to an output or seat is freed when its global goes
+// away, so that repeatedly plugging in a monitor doesn't leak its buffers
+
+// Stops seats from referring to a surface that is about to be destroyed
+static void seat_forget_surface(struct desktop_surface *surface) {
+  struct seat *seat;
+  wl_list_for_each(seat, &seat_list, link) {
+    if (seat->pointer.surface == surface) {
+      seat->pointer.surface = NULL;
+    }
+    if (seat->keyboard.surface == surface) {
+      keyboard_stop_repeat(seat);
+      seat->keyboard.surface = NULL;
+    }
+  }
+}
+
+// Search
+//
+// Weston's desktop shell never gives keyboard focus to the background or the
+// panel, so typing goes to a small toplevel window instead, which the
+// compositor focuses when it maps like any other. Clicking the background
+// beside the menu opens it for that output. It shows the filter of the
+// output's menu, and closes, clearing the filter, on Escape, Return or when it
+// loses focus
+#define SEARCH_WIDTH (400)
+#define SEARCH_HEIGHT (40)
+#define SEARCH_PADDING (10)
+
+static void draw_search(struct search *search) {
+  search->needs_draw = false;
+  if (!search->configured) {
+    return;
+  }
+
+  int32_t scale = search->scale;
+  uint32_t width = SEARCH_WIDTH * scale;
+  uint32_t height = SEARCH_HEIGHT * scale;
+  uint32_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+  swapchain_resize(&search->swapchain, width, height, stride);
+
+  // Small enough to redraw whole on every key
+  cairo_rectangle_int_t rect = {0, 0, width, height};
+  cairo_region_t *damage = cairo_region_create_rectangle(&rect);
+  struct buffer *buffer = swapchain_acquire(&search->swapchain, damage);
+  if (!buffer) {
+    search->needs_draw = true;
+    cairo_region_destroy(damage);
+    return;
+  }
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      buffer_data(buffer), CAIRO_FORMAT_RGB24, width, height, stride);
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
+  cairo_paint(cr);
+
+  set_panel_font(cr, scale);
+  cairo_font_extents_t extents;
+  cairo_font_extents(cr, &extents);
+  GString *query = search->output->background->menu->query;
+  if (query->len) {
+    cairo_set_source_rgb(cr, 1, 1, 1);
+  } else {
+    cairo_set_source_rgb(cr, 0.6, 0.6, 0.6);
+  }
+  cairo_move_to(cr, SEARCH_PADDING * scale,
+                (height - extents.height) / 2 + extents.ascent);
+  cairo_show_text(cr, query->len ? query->str : "Type to search");
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+
+  swapchain_present(&search->swapchain, buffer, search->surface, damage);
+  cairo_region_destroy(damage);
+  wl_surface_set_buffer_scale(search->surface, scale);
+  wl_surface_commit(search->surface);
+}
+
+static void search_buffer_released(void *data) {
+  struct search *search = data;
+  if (search->needs_draw) {
+    draw_search(search);
+  }
+}
+
+static void close_search(struct search *search) {
+  seat_forget_surface(&search->base);
+  xdg_toplevel_destroy(search->toplevel);
+  xdg_surface_destroy(search->xdg_surface);
+  wl_surface_destroy(search->surface);
+  finish_swapchain(&search->swapchain);
+
+  struct menu *menu = search->output->background->menu;
+  if (menu->query->len) {
+    menu_set_query(menu, "");
+  }
+  search->output->search = NULL;
+  free(search);
+}
+
+static void search_key(void *data, struct seat *seat, xkb_keysym_t sym,
+                       char const *text) {
+  struct search *search = data;
+  menu_key(search->output->background->menu, seat, sym, text);
+  if (sym == XKB_KEY_Escape || sym == XKB_KEY_Return ||
+      sym == XKB_KEY_KP_Enter) {
+    close_search(search);
+  } else {
+    draw_search(search);
+  }
+}
+
+static void search_keyboard_leave(void *data, struct seat *seat) {
+  close_search(data);
+}
+
+static void search_surface_configure(void *data,
+                                     struct xdg_surface *xdg_surface,
+                                     uint32_t serial) {
+  struct search *search = data;
+  xdg_surface_ack_configure(xdg_surface, serial);
+  search->configured = true;
+  draw_search(search);
+}
+
+static const struct xdg_surface_listener search_surface_listener = {
+    search_surface_configure,
+};
+
+// The window keeps its size whatever the compositor suggests
+static void search_toplevel_configure(void *data,
+                                      struct xdg_toplevel *xdg_toplevel,
+                                      int32_t width, int32_t height,
+                                      struct wl_array *states) {}
+
+static void search_toplevel_close(void *data,
+                                  struct xdg_toplevel *xdg_toplevel) {
+  close_search(data);
+}
+
+static void search_toplevel_configure_bounds(void *data,
+                                             struct xdg_toplevel *xdg_toplevel,
+                                             int32_t width, int32_t height) {}
+
+static void search_toplevel_wm_capabilities(void *data,
+                                            struct xdg_toplevel *xdg_toplevel,
+                                            struct wl_array *capabilities) {}
+
+static const struct xdg_toplevel_listener search_toplevel_listener = {
+    search_toplevel_configure,
+    search_toplevel_close,
+    search_toplevel_configure_bounds,
+    search_toplevel_wm_capabilities,
+};
+
+static void open_search(struct output *output) {
+  if (output->search || !output->background) {
+    return;
+  }
+
+  struct search *s = calloc(1, sizeof(*s));
+  s->output = output;
+  s->scale = MAX(output->scale, 1);
+  init_swapchain(&s->swapchain, &output->pool, WL_SHM_FORMAT_XRGB8888,
+                 search_buffer_released, s);
+
+  s->surface = wl_compositor_create_surface(compositor);
+  wl_surface_add_listener(s->surface, &desktop_surface_listener, s);
+  s->base.cursor = "left_ptr";
+  s->base.output = output;
+  s->base.on_key = search_key;
+  s->base.on_keyboard_leave = search_keyboard_leave;
+
+  s->xdg_surface = xdg_wm_base_get_xdg_surface(xdg_wm_base, s->surface);
+  xdg_surface_add_listener(s->xdg_surface, &search_surface_listener, s);
+  s->toplevel = xdg_surface_get_toplevel(s->xdg_surface);
+  xdg_toplevel_add_listener(s->toplevel, &search_toplevel_listener, s);
+  xdg_toplevel_set_title(s->toplevel, "Search applications");
+  xdg_toplevel_set_app_id(s->toplevel, "weston-desktop-matchbox");
+  xdg_toplevel_set_min_size(s->toplevel, SEARCH_WIDTH, SEARCH_HEIGHT);
+  xdg_toplevel_set_max_size(s->toplevel, SEARCH_WIDTH, SEARCH_HEIGHT);
+  wl_surface_commit(s->surface);
+
+  output->search = s;
+}
+
+static void destroy_background(struct background *background) {
+  seat_forget_surface(&background->menu->base);
+  seat_forget_surface(&background->base);
+
+  destroy_menu(background->menu);
+  wp_viewport_destroy(background->viewport);
+  wl_surface_destroy(background->surface);
+  finish_swapchain(&background->swapchain);
+  if (background->wallpaper) {
+    wl_buffer_destroy(background->wallpaper);
+  }
+  if (background->wallpaper_load) {
+    g_cancellable_cancel(background->wallpaper_load);
+    g_object_unref(background->wallpaper_load);
+  }
+  free(background);
+}
+
+static void destroy_output(struct output *output) {
+  if (output->search) {
+    close_search(output->search);
+  }
+  if (output->background) {
+    destroy_background(output->background);
+  }
+  if (output->panel) {
+    seat_forget_surface(&output->panel->base);
+    destroy_panel(output->panel);
+  }
+  // Surfaces are gone, so nothing can still be using the buffers
+  finish_shm_pool(&output->pool);
+
+  if (wl_output_get_version(output->output) >=
+      WL_OUTPUT_RELEASE_SINCE_VERSION) {
+    wl_output_release(output->output);
+  } else {
+    wl_output_destroy(output->output);
+  }
+  wl_list_remove(&output->link);
+  free(output);
+}
+
+static void destroy_seat(struct seat *seat) {
+  if (seat->pointer.pointer) {
+    seat_release_pointer(seat);
+  }
+  if (seat->keyboard.keyboard) {
+    seat_release_keyboard(seat);
+  }
+  if (wl_seat_get_version(seat->seat) >= WL_SEAT_RELEASE_SINCE_VERSION) {
+    wl_seat_release(seat->seat);
+  } else {
+    wl_seat_destroy(seat->seat);
+  }
+  wl_list_remove(&seat->link);
+  free(seat);
+}
+
+// Registry
+static void registry_global(void *data, struct wl_registry *wl_registry,
+                            uint32_t name, char const *interface,
+                            uint32_t version) {
+  if (strcmp(interface, "wl_compositor") == 0) {
+    compositor = wl_registry_bind(registry, name, &wl_compositor_interface,
+                                  MIN(version, 5));
+  } else if (strcmp(interface, "wl_seat") == 0) {
+    struct seat *seat = calloc(1, sizeof(*seat));
+    seat->name = name;
+    seat->seat =
+        wl_registry_bind(registry, name, &wl_seat_interface, MIN(version, 5));
+    wl_seat_add_listener(seat->seat, &seat_listener, seat);
+    wl_list_insert(&seat_list, &seat->link);
+
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    shm = wl_registry_bind(registry, name, &wl_shm_interface, MIN(version, 1));
+    wl_shm_add_listener(shm, &shm_listener, NULL);
+  } else if (strcmp(interface, "weston_desktop_shell") == 0) {
+    desktop_shell = wl_registry_bind(
+        registry, name, &weston_desktop_shell_interface, MIN(version, 1));
+    weston_desktop_shell_add_listener(desktop_shell, &desktop_shell_listener,
+                                      NULL);
+
+  } else if (strcmp(interface, "xdg_wm_base") == 0) {
+    xdg_wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface,
+                                   MIN(version, 4));
+    xdg_wm_base_add_listener(xdg_wm_base, &xdg_wm_base_listener, NULL);
+
+  } else if (strcmp(interface, "wp_viewporter") == 0) {
+    viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface,
+                                  MIN(version, 1));
+
+  } else if (strcmp(interface, "wp_fractional_scale_manager_v1") == 0) {
+    fractional_scale_manager = wl_registry_bind(
+        registry, name, &wp_fractional_scale_manager_v1_interface, 1);
+
+  } else if (strcmp(interface, "xdg_activation_v1") == 0) {
+    xdg_activation =
+        wl_registry_bind(registry, name, &xdg_activation_v1_interface, 1);
+
+  } else if (strcmp(interface, "wl_subcompositor") == 0) {
+    subcompositor = wl_registry_bind(registry, name,
+                                     &wl_subcompositor_interface, 1);
+
+  } else if (strcmp(interface, "wl_output") == 0) {
+    struct output *output = calloc(1, sizeof(*output));
+    output->name = name;
+    output->output =
+        wl_registry_bind(registry, name, &wl_output_interface, MIN(version, 4));
+    output->scale = 1;
+    init_shm_pool(&output->pool);
+    wl_output_add_listener(output->output, &output_listener, output);
+    wl_list_insert(&output_list, &output->link);
+
+    need_roundtrip = true;
+  }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *wl_registry,
+                                   uint32_t name) {
+  struct output *output;
+  wl_list_for_each(output, &output_list, link) {
+    if (output->name == name) {
+      destroy_output(output);
+      return;
+    }
+  }
+
+  struct seat *seat;
+  wl_list_for_each(seat, &seat_list, link) {
+    if (seat->name == name) {
+      destroy_seat(seat);
+      return;
+    }
+  }
+}
+
+static const struct wl_registry_listener registry_listener = {
+    registry_global,
+    registry_global_remove,
+};
+
+// Config
+static char *config_get_string(GKeyFile *keyfile, char const *key) {
+  return g_key_file_get_string(keyfile, "shell", key, NULL);
+}
+
+static char **config_get_string_list(GKeyFile *keyfile, char const *key) {
+  return g_key_file_get_string_list(keyfile, "shell", key, NULL, NULL);
+}
+
+static bool config_get_bool(GKeyFile *keyfile, char const *key, bool def) {
+  GError *error = NULL;
+  bool value = g_key_file_get_boolean(keyfile, "shell", key, &error);
+  if (error) {
+    g_error_free(error);
+    return def;
+  }
+  return value;
+}
+
+static int config_get_int(GKeyFile *keyfile, char const *key, int def) {
+  GError *error = NULL;
+  int value = g_key_file_get_integer(keyfile, "shell", key, &error);
+  if (error) {
+    g_error_free(error);
+    return def;
+  }
+  return value;
+}
+
+// Opens weston.ini. Weston passes the path of the file it was started with in
+// WESTON_CONFIG_FILE
+static GKeyFile *open_config(void) {
+  char *path;
+  if (g_getenv("WESTON_CONFIG_FILE")) {
+    path = g_strdup(g_getenv("WESTON_CONFIG_FILE"));
+  } else {
+    path = g_build_filename(g_get_user_config_dir(), "weston.ini", NULL);
+  }
+
+  GKeyFile *keyfile = g_key_file_new();
+  GError *error = NULL;
+  if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, &error)) {
+    if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      fprintf(stderr, "Unable to load config '%s': %s\n", path,
+              error->message);
+    }
+    g_clear_error(&error);
+  }
+  g_free(path);
+  return keyfile;
+}
+
+// Reads the [shell] section of weston.ini
+static void load_config(GKeyFile *keyfile) {
+  config.background_downscale =
+      config_get_int(keyfile, "background-downscale", 0);
+  config.launch_log = config_get_string(keyfile, "launch-log");
+  config.launcher_helper = config_get_bool(keyfile, "launcher-helper", false);
+  config.launcher_preload = config_get_string_list(keyfile, "launcher-preload");
+  config.background_image = config_get_string(keyfile, "background-image");
+  if (config.background_image && !*config.background_image) {
+    g_clear_pointer(&config.background_image, g_free);
+  }
+  config.background_type = BACKGROUND_TILE;
+  char *type = config_get_string(keyfile, "background-type");
+  if (type) {
+    static char const *const types[] = {
+        [BACKGROUND_SCALE] = "scale",
+        [BACKGROUND_SCALE_CROP] = "scale-crop",
+        [BACKGROUND_TILE] = "tile",
+        [BACKGROUND_CENTERED] = "centered",
+    };
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(types); i++) {
+      if (strcmp(type, types[i]) == 0) {
+        config.background_type = i;
+        break;
+      }
+    }
+    if (i == G_N_ELEMENTS(types)) {
+      fprintf(stderr, "Unknown background-type '%s'\n", type);
+    }
+    g_free(type);
+  }
+  config.background_color = 0xff808080;
+  char *color = config_get_string(keyfile, "background-color");
+  if (color) {
+    config.background_color = g_ascii_strtoull(color, NULL, 0);
+    g_free(color);
+  }
+  config.idle_timeout = config_get_int(keyfile, "idle-timeout", 60);
+  config.panel_position = WESTON_DESKTOP_SHELL_PANEL_POSITION_TOP;
+  char *position = config_get_string(keyfile, "panel-position");
+  if (position) {
+    if (strcmp(position, "bottom") == 0) {
+      config.panel_position = WESTON_DESKTOP_SHELL_PANEL_POSITION_BOTTOM;
+    } else if (strcmp(position, "none") == 0) {
+      config.panel_position = PANEL_POSITION_NONE;
+    } else if (strcmp(position, "top") != 0) {
+      fprintf(stderr, "Unsupported panel-position '%s', using top\n",
+              position);
+    }
+    g_free(position);
+  }
+  config.panel_launchers = config_get_string_list(keyfile, "panel-launchers");
+  config.menu_frequent = MAX(config_get_int(keyfile, "menu-frequent", 0), 0);
+  config.trace_file = config_get_string(keyfile, "trace-file");
+  config.cursor_theme = config_get_string(keyfile, "cursor-theme");
+  config.cursor_size = config_get_int(keyfile, "cursor-size", 32);
+  if (config.cursor_size <= 0) {
+    config.cursor_size = 32;
+  }
+}
+
+// Application discovery
+static bool discovery_running;
+// The files application_list was read from, or none until it has been checked
+// against them
+static struct app_dirs known_files;
+// Set when applications changed while a scan was already running
+static bool rescan_pending;
+
+static void finish_app_discovery(GObject *source, GAsyncResult *result,
+                                 gpointer data);
+static void start_app_discovery(void);
+
+// Application index
+//
+// The visible applications and their sort keys are cached so that startup
+// doesn't have to parse every .desktop file. The index is valid as long as the
+// language and desktop environment, and the modification time and size of
+// every applications directory and desktop file, found recursively under the
+// XDG data directories, are the same as when it was written. Directories
+// catch files being added, removed or renamed, and the files catch edits in
+// place. Checking all of that takes a walk of the directories, so the menu is
+// shown from the index straight away and the walk runs on a worker thread,
+// which starts a rescan if anything changed. The file is native endian and
+// consists of a header, the files (the roots first), the applications in menu
+// order and a table of NUL terminated strings that the others refer to by
+// offset
+#define APP_INDEX_MAGIC "WDMAPPS"
+#define APP_INDEX_VERSION (2)
+#define APP_INDEX_VISIBLE (1 << 0)
+// Guards against symlink loops
+#define APP_INDEX_MAX_DEPTH (8)
+
+struct app_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t locale;
+  uint32_t desktop;
+  uint32_t n_roots;
+  uint32_t n_files;
+  uint32_t n_apps;
+  uint32_t strings_size;
+  uint32_t reserved;
+};
+
+// Modification time in nanoseconds and size of a file, or -1 and 0 if it
+// doesn't exist
+struct file_stamp {
+  int64_t mtime;
+  int64_t size;
+};
+
+struct app_index_file {
+  struct file_stamp stamp;
+  uint32_t path;
+  uint32_t reserved;
+};
+
+struct app_index_app {
+  uint32_t id;
+  uint32_t name;
+  uint32_t sort_key;
+  uint32_t flags;
+};
+
+// The directories and desktop files a scan depends on, with their stamps
+struct app_dirs {
+  GPtrArray *paths;
+  GArray *stamps;
+  guint n_roots;
+};
+
+static char *app_index_path(void) {
+  return g_build_filename(g_get_user_cache_dir(), "weston-desktop-matchbox",
+                          "apps.index", NULL);
+}
+
+// The names in desktop files are translated, so the index is only valid for
+// the language it was written in
+static char *app_index_locale(void) {
+  return g_strjoinv(":", (char **)g_get_language_names());
+}
+
+// OnlyShowIn and NotShowIn make which applications are visible depend on the
+// desktop environment
+static char const *app_index_desktop(void) {
+  char const *desktop = g_getenv("XDG_CURRENT_DESKTOP");
+  return desktop ? desktop : "";
+}
+
+static struct file_stamp stat_stamp(char const *path, mode_t *mode) {
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    *mode = 0;
+    return (struct file_stamp){-1, 0};
+  }
+  *mode = st.st_mode;
+  return (struct file_stamp){
+      (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec,
+      st.st_size,
+  };
+}
+
+static void app_dirs_add(struct app_dirs *dirs, char const *path,
+                         struct file_stamp stamp) {
+  g_ptr_array_add(dirs->paths, g_strdup(path));
+  g_array_append_val(dirs->stamps, stamp);
+}
+
+static void app_dirs_add_children(struct app_dirs *dirs, char const *path,
+                                  int depth) {
+  GDir *dir = g_dir_open(path, 0, NULL);
+  if (!dir) {
+    return;
+  }
+
+  char const *name;
+  while ((name = g_dir_read_name(dir))) {
+    char *child = g_build_filename(path, name, NULL);
+    mode_t mode;
+    struct file_stamp stamp = stat_stamp(child, &mode);
+    if (S_ISDIR(mode)) {
+      app_dirs_add(dirs, child, stamp);
+      if (depth < APP_INDEX_MAX_DEPTH) {
+        app_dirs_add_children(dirs, child, depth + 1);
+      }
+    } else if (S_ISREG(mode) && g_str_has_suffix(name, ".desktop")) {
+      app_dirs_add(dirs, child, stamp);
+    }
+    g_free(child);
+  }
+  g_dir_close(dir);
+}
+
+// The directories GIO reads desktop files from
+static GPtrArray *app_dir_roots(void) {
+  GPtrArray *roots = g_ptr_array_new_with_free_func(g_free);
+  g_ptr_array_add(roots, g_build_filename(g_get_user_data_dir(),
+                                          "applications", NULL));
+  for (char const *const *dir = g_get_system_data_dirs(); *dir; dir++) {
+    g_ptr_array_add(roots, g_build_filename(*dir, "applications", NULL));
+  }
+  return roots;
+}
+
+static void init_app_dirs(struct app_dirs *dirs) {
+  dirs->paths = g_ptr_array_new_with_free_func(g_free);
+  dirs->stamps = g_array_new(FALSE, FALSE, sizeof(struct file_stamp));
+  dirs->n_roots = 0;
+}
+
+static void scan_app_dirs(struct app_dirs *dirs) {
+  init_app_dirs(dirs);
+
+  // The roots go first so that a change to the search path can be detected
+  // without walking anything
+  GPtrArray *roots = app_dir_roots();
+  dirs->n_roots = roots->len;
+  for (guint i = 0; i < roots->len; i++) {
+    mode_t mode;
+    struct file_stamp stamp = stat_stamp(roots->pdata[i], &mode);
+    if (!S_ISDIR(mode)) {
+      stamp = (struct file_stamp){-1, 0};
+    }
+    app_dirs_add(dirs, roots->pdata[i], stamp);
+  }
+  for (guint i = 0; i < roots->len; i++) {
+    app_dirs_add_children(dirs, roots->pdata[i], 1);
+  }
+  g_ptr_array_free(roots, TRUE);
+}
+
+static void free_app_dirs(struct app_dirs *dirs) {
+  if (!dirs->paths) {
+    return;
+  }
+  g_ptr_array_free(dirs->paths, TRUE);
+  g_array_free(dirs->stamps, TRUE);
+  dirs->paths = NULL;
+}
+
+static uint32_t index_add_string(GString *strings, char const *str) {
+  uint32_t offset = strings->len;
+  g_string_append_len(strings, str, strlen(str) + 1);
+  return offset;
+}
+
+// Writes the index for the applications GIO found. The directories must have
+// been scanned before the applications were, so that a change made during the
+// scan leaves the index stale rather than missing it
+static void write_app_index(struct app_dirs *dirs, GPtrArray *all_apps) {
+  GString *strings = g_string_new(NULL);
+  GArray *index_files =
+      g_array_new(FALSE, TRUE, sizeof(struct app_index_file));
+  GArray *index_apps = g_array_new(FALSE, TRUE, sizeof(struct app_index_app));
+
+  struct app_index_header header = {
+      .magic = APP_INDEX_MAGIC,
+      .version = APP_INDEX_VERSION,
+      .n_roots = dirs->n_roots,
+  };
+  char *locale = app_index_locale();
+  header.locale = index_add_string(strings, locale);
+  g_free(locale);
+  header.desktop = index_add_string(strings, app_index_desktop());
+
+  for (guint i = 0; i < dirs->paths->len; i++) {
+    struct app_index_file file = {
+        .stamp = g_array_index(dirs->stamps, struct file_stamp, i),
+        .path = index_add_string(strings, dirs->paths->pdata[i]),
+    };
+    g_array_append_val(index_files, file);
+  }
+
+  for (guint i = 0; i < all_apps->len; i++) {
+    struct app_entry *entry = all_apps->pdata[i];
+    if (!entry->id) {
+      continue;
+    }
+    struct app_index_app app = {
+        .id = index_add_string(strings, entry->id),
+        .name = index_add_string(strings, entry->name),
+        .sort_key = index_add_string(strings, entry->sort_key),
+        .flags = app_entry_visible(entry) ? APP_INDEX_VISIBLE : 0,
+    };
+    g_array_append_val(index_apps, app);
+  }
+
+  header.n_files = index_files->len;
+  header.n_apps = index_apps->len;
+  header.strings_size = strings->len;
+
+  GByteArray *data = g_byte_array_new();
+  g_byte_array_append(data, (guint8 *)&header, sizeof(header));
+  g_byte_array_append(data, (guint8 *)index_files->data,
+                      index_files->len * sizeof(struct app_index_file));
+  g_byte_array_append(data, (guint8 *)index_apps->data,
+                      index_apps->len * sizeof(struct app_index_app));
+  g_byte_array_append(data, (guint8 *)strings->str, strings->len);
+
+  char *path = app_index_path();
+  char *dir = g_path_get_dirname(path);
+  GError *error = NULL;
+  if (g_mkdir_with_parents(dir, 0700) < 0 ||
+      !g_file_set_contents(path, (char *)data->data, data->len, &error)) {
+    fprintf(stderr, "Unable to write application index '%s': %s\n", path,
+            error ? error->message : g_strerror(errno));
+    g_clear_error(&error);
+  }
+  g_free(dir);
+  g_free(path);
+
+  g_byte_array_free(data, TRUE);
+  g_array_free(index_apps, TRUE);
+  g_array_free(index_files, TRUE);
+  g_string_free(strings, TRUE);
+}
+
+static char const *index_string(struct app_index_header const *header,
+                                char const *strings, uint32_t offset) {
+  return offset < header->strings_size ? strings + offset : NULL;
+}
+
+// Checks what can be checked without touching the disk: that the index was
+// written for this language, desktop and search path
+static bool app_index_matches(struct app_index_header const *header,
+                              struct app_index_file const *files,
+                              char const *strings) {
+  char *locale = app_index_locale();
+  bool valid =
+      g_strcmp0(index_string(header, strings, header->locale), locale) == 0 &&
+      g_strcmp0(index_string(header, strings, header->desktop),
+                app_index_desktop()) == 0;
+  g_free(locale);
+
+  GPtrArray *roots = app_dir_roots();
+  valid = valid && roots->len == header->n_roots;
+  for (guint i = 0; valid && i < roots->len; i++) {
+    valid = g_strcmp0(index_string(header, strings, files[i].path),
+                      roots->pdata[i]) == 0;
+  }
+  g_ptr_array_free(roots, TRUE);
+  return valid;
+}
+
+// Whether a scan right now would find the same directories and desktop files
+// as the one the index was written from
+static bool app_dirs_unchanged(struct app_dirs *indexed) {
+  struct app_dirs current;
+  scan_app_dirs(&current);
+  bool unchanged = current.paths->len == indexed->paths->len;
+  for (guint i = 0; unchanged && i < current.paths->len; i++) {
+    struct file_stamp *a =
+        &g_array_index(current.stamps, struct file_stamp, i);
+    struct file_stamp *b =
+        &g_array_index(indexed->stamps, struct file_stamp, i);
+    unchanged =
+        strcmp(current.paths->pdata[i], indexed->paths->pdata[i]) == 0 &&
+        a->mtime == b->mtime && a->size == b->size;
+  }
+  free_app_dirs(&current);
+  return unchanged;
+}
+
+// Fills application_list from the index, and indexed with the files it was
+// written from. Returns false if there is no usable index, in which case the
+// applications have to be discovered. The files aren't checked yet, that is
+// left to start_check_app_index()
+static bool load_app_index(struct app_dirs *indexed) {
+  char *path = app_index_path();
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  g_free(path);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      st.st_size >= (off_t)sizeof(struct app_index_header)) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  struct app_index_header const *header = data;
+  struct app_index_file const *files = (void const *)(header + 1);
+  struct app_index_app const *apps = (void const *)(files + header->n_files);
+  char const *strings = (char const *)(apps + header->n_apps);
+
+  uint64_t expected = sizeof(*header) +
+                      (uint64_t)header->n_files * sizeof(*files) +
+                      (uint64_t)header->n_apps * sizeof(*apps) +
+                      header->strings_size;
+  bool valid = !memcmp(header->magic, APP_INDEX_MAGIC, sizeof(header->magic)) &&
+               header->version == APP_INDEX_VERSION &&
+               expected == (uint64_t)st.st_size && header->strings_size &&
+               strings[header->strings_size - 1] == '\0' &&
+               header->n_roots <= header->n_files &&
+               app_index_matches(header, files, strings);
+
+  init_app_dirs(indexed);
+  indexed->n_roots = header->n_roots;
+  for (uint32_t i = 0; valid && i < header->n_files; i++) {
+    char const *file = index_string(header, strings, files[i].path);
+    if (!file) {
+      valid = false;
+    } else {
+      app_dirs_add(indexed, file, files[i].stamp);
+    }
+  }
+
+  // The index is written in menu order
+  for (uint32_t i = 0; valid && i < header->n_apps; i++) {
+    char const *id = index_string(header, strings, apps[i].id);
+    char const *name = index_string(header, strings, apps[i].name);
+    char const *sort_key = index_string(header, strings, apps[i].sort_key);
+    if (!id || !name || !sort_key) {
+      valid = false;
+    } else if (apps[i].flags & APP_INDEX_VISIBLE) {
+      g_ptr_array_add(application_list,
+                      create_app_entry(id, name, sort_key));
+    }
+  }
+  munmap(data, st.st_size);
+
+  if (!valid) {
+    free_app_dirs(indexed);
+    for (guint i = 0; i < application_list->len; i++) {
+      free_app_entry(application_list->pdata[i]);
+    }
+    g_ptr_array_set_size(application_list, 0);
+    return false;
+  }
+  return true;
+}
+
+// The files the index was written from, and the ids of the applications to
+// look up if it is up to date
+struct app_index_check {
+  struct app_dirs indexed;
+  GPtrArray *ids;
+};
+
+static void free_app_index_check(struct app_index_check *check) {
+  free_app_dirs(&check->indexed);
+  g_ptr_array_free(check->ids, TRUE);
+  free(check);
+}
+
+// Checks the index against the files off the main thread, and looks up the
+// GAppInfo of the entries that are needed before they are launched. Looking
+// up any application makes GIO read the directory listings and start
+// monitoring them, without parsing the other desktop files. The rest are
+// looked up when they are launched. Returns NULL if the index is out of date
+static void check_app_index(GTask *task, gpointer source, gpointer data,
+                            GCancellable *cancellable) {
+  struct app_index_check *check = data;
+  GPtrArray *ids = check->ids;
+  bool unchanged = app_dirs_unchanged(&check->indexed);
+
+  GHashTable *infos =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+  for (guint i = 0; unchanged && i < ids->len; i++) {
+    GDesktopAppInfo *info = g_desktop_app_info_new(ids->pdata[i]);
+    if (info) {
+      g_hash_table_insert(infos, g_strdup(ids->pdata[i]), info);
+    }
+  }
+  if (!unchanged) {
+    g_clear_pointer(&infos, g_hash_table_destroy);
+  }
+  g_task_return_pointer(task, infos, (GDestroyNotify)g_hash_table_destroy);
+}
+
+static void finish_check_app_index(GObject *source, GAsyncResult *result,
+                                   gpointer data) {
+  GHashTable *infos = g_task_propagate_pointer(G_TASK(result), NULL);
+  struct app_index_check *check = g_task_get_task_data(G_TASK(result));
+
+  // The list was read from the indexed files, so a rescan started before
+  // this finished is the only thing that knows newer ones
+  if (!discovery_running && !known_files.paths) {
+    known_files = check->indexed;
+    check->indexed.paths = NULL;
+  }
+  if (!infos) {
+    // The rescan replaces the entries that changed and rewrites the index
+    start_app_discovery();
+    return;
+  }
+
+  for (guint i = 0; i < application_list->len; i++) {
+    struct app_entry *entry = application_list->pdata[i];
+    GAppInfo *info = entry->id ? g_hash_table_lookup(infos, entry->id) : NULL;
+    if (!entry->info && info) {
+      entry->info = g_object_ref(info);
+    }
+  }
+  g_hash_table_destroy(infos);
+  launcher_helper_preload();
+}
+
+// Takes over indexed
+static void start_check_app_index(struct app_dirs *indexed) {
+  struct app_index_check *check = calloc(1, sizeof(*check));
+  check->indexed = *indexed;
+
+  // The applications the helper preloads, now and once the shell is idle.
+  // Any one will do to get GIO monitoring if there are none
+  GPtrArray *ids = g_ptr_array_new_with_free_func(g_free);
+  check->ids = ids;
+  GPtrArray *top = usage_top_apps(USAGE_PRELOAD_APPS);
+  for (guint i = 0; i < application_list->len; i++) {
+    struct app_entry *entry = application_list->pdata[i];
+    bool preload =
+        config.launcher_preload &&
+        g_strv_contains((char const *const *)config.launcher_preload,
+                        entry->id);
+    guint index;
+    if (preload || g_ptr_array_find(top, entry, &index) ||
+        (i == 0 && !top->len)) {
+      g_ptr_array_add(ids, g_strdup(entry->id));
+    }
+  }
+  g_ptr_array_free(top, TRUE);
+
+  GTask *task = g_task_new(NULL, NULL, finish_check_app_index, NULL);
+  g_task_set_task_data(task, check, (GDestroyNotify)free_app_index_check);
+  g_task_run_in_thread(task, check_app_index);
+  g_object_unref(task);
+}
+
+struct app_scan {
+  // The files and applications an incremental rescan starts from, or no
+  // files for a full one
+  struct app_dirs known;
+  GPtrArray *known_apps;
+  // The files the result was read from
+  struct app_dirs files;
+};
+
+static void free_app_scan(struct app_scan *scan) {
+  free_app_dirs(&scan->known);
+  if (scan->known_apps) {
+    free_app_list(scan->known_apps);
+  }
+  free_app_dirs(&scan->files);
+  free(scan);
+}
+
+static bool app_dirs_same_roots(struct app_dirs *a, struct app_dirs *b) {
+  if (a->n_roots != b->n_roots) {
+    return false;
+  }
+  for (guint i = 0; i < a->n_roots; i++) {
+    if (strcmp(a->paths->pdata[i], b->paths->pdata[i]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The desktop file id GIO gives a file under one of the roots: its path
+// below the root with '/' replaced by '-'
+static char *desktop_file_id(struct app_dirs *dirs, char const *path) {
+  for (guint i = 0; i < dirs->n_roots; i++) {
+    char const *root = dirs->paths->pdata[i];
+    size_t len = strlen(root);
+    if (strncmp(path, root, len) == 0 && path[len] == '/') {
+      char *id = g_strdup(path + len + 1);
+      g_strdelimit(id, "/", '-');
+      return id;
+    }
+  }
+  return NULL;
+}
+
+static void add_changed_id(GPtrArray *ids, GHashTable *seen, char *id) {
+  if (!id || g_hash_table_contains(seen, id)) {
+    g_free(id);
+    return;
+  }
+  g_hash_table_add(seen, id);
+  g_ptr_array_add(ids, id);
+}
+
+// Returns the ids of the desktop files that were added, removed or changed
+// between two scans. The directories themselves don't matter, since the
+// files in them are listed either way
+static GPtrArray *changed_desktop_ids(struct app_dirs *old,
+                                      struct app_dirs *current) {
+  GHashTable *old_stamps = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint i = old->n_roots; i < old->paths->len; i++) {
+    g_hash_table_insert(old_stamps, old->paths->pdata[i],
+                        &g_array_index(old->stamps, struct file_stamp, i));
+  }
+
+  GPtrArray *ids = g_ptr_array_new_with_free_func(g_free);
+  GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint i = current->n_roots; i < current->paths->len; i++) {
+    char const *path = current->paths->pdata[i];
+    struct file_stamp *stamp =
+        &g_array_index(current->stamps, struct file_stamp, i);
+    struct file_stamp *was = g_hash_table_lookup(old_stamps, path);
+    g_hash_table_remove(old_stamps, path);
+    if (!g_str_has_suffix(path, ".desktop") ||
+        (was && was->mtime == stamp->mtime && was->size == stamp->size)) {
+      continue;
+    }
+    add_changed_id(ids, seen, desktop_file_id(current, path));
+  }
+
+  // Whatever is left was removed
+  GHashTableIter iter;
+  gpointer path;
+  g_hash_table_iter_init(&iter, old_stamps);
+  while (g_hash_table_iter_next(&iter, &path, NULL)) {
+    if (g_str_has_suffix(path, ".desktop")) {
+      add_changed_id(ids, seen, desktop_file_id(old, path));
+    }
+  }
+
+  g_hash_table_destroy(seen);
+  g_hash_table_destroy(old_stamps);
+  return ids;
+}
+
+static GPtrArray *read_all_apps(void) {
+  GList *app_list = g_app_info_get_all();
+  GPtrArray *all = g_ptr_array_new();
+  for (GList *cur = app_list; cur != NULL; cur = cur->next) {
+    g_ptr_array_add(all, app_entry_from_info(cur->data));
+  }
+  g_list_free_full(app_list, g_object_unref);
+  return all;
+}
+
+// Takes the known applications and replaces the ones whose desktop files
+// changed with what GIO finds for their ids now. Looking up an id only parses
+// the file it resolves to, which may be one another root no longer shadows
+static GPtrArray *read_changed_apps(struct app_scan *scan) {
+  GPtrArray *ids = changed_desktop_ids(&scan->known, &scan->files);
+  GHashTable *changed = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint i = 0; i < ids->len; i++) {
+    g_hash_table_add(changed, ids->pdata[i]);
+  }
+
+  GPtrArray *all = g_ptr_array_sized_new(scan->known_apps->len);
+  for (guint i = 0; i < scan->known_apps->len; i++) {
+    struct app_entry *entry = scan->known_apps->pdata[i];
+    if (entry->id && g_hash_table_contains(changed, entry->id)) {
+      free_app_entry(entry);
+    } else {
+      g_ptr_array_add(all, entry);
+    }
+  }
+  g_ptr_array_free(scan->known_apps, TRUE);
+  scan->known_apps = NULL;
+
+  for (guint i = 0; i < ids->len; i++) {
+    GDesktopAppInfo *info = g_desktop_app_info_new(ids->pdata[i]);
+    if (info) {
+      g_ptr_array_add(all, app_entry_from_info(G_APP_INFO(info)));
+      g_object_unref(info);
+    }
+  }
+
+  g_hash_table_destroy(changed);
+  g_ptr_array_free(ids, TRUE);
+  return all;
+}
+
+// Scans for applications off the main thread and rewrites the index. When
+// the files the current list was read from are known only the desktop files
+// that changed since are read, otherwise GIO reads every one of them.
+// Returns the sorted list of applications to show
+static void discover_apps(GTask *task, gpointer source, gpointer data,
+                          GCancellable *cancellable) {
+  struct app_scan *scan = data;
+  scan_app_dirs(&scan->files);
+
+  // Moving the roots around changes which file every id resolves to
+  GPtrArray *all;
+  if (scan->known.paths && app_dirs_same_roots(&scan->known, &scan->files)) {
+    all = read_changed_apps(scan);
+  } else {
+    all = read_all_apps();
+  }
+  g_ptr_array_sort(all, sort_apps);
+
+  write_app_index(&scan->files, all);
+
+  GPtrArray *apps = g_ptr_array_sized_new(all->len);
+  for (guint i = 0; i < all->len; i++) {
+    struct app_entry *entry = all->pdata[i];
+    if (app_entry_visible(entry)) {
+      g_ptr_array_add(apps, entry);
+    } else {
+      free_app_entry(entry);
+    }
+  }
+  g_ptr_array_free(all, TRUE);
+
+  g_task_return_pointer(task, apps, NULL);
+}
+
+static void start_app_discovery(void) {
+  discovery_running = true;
+  struct app_scan *scan = calloc(1, sizeof(*scan));
+  if (known_files.paths) {
+    scan->known = known_files;
+    known_files.paths = NULL;
+    scan->known_apps = g_ptr_array_sized_new(application_list->len);
+    for (guint i = 0; i < application_list->len; i++) {
+      struct app_entry *entry = application_list->pdata[i];
+      g_ptr_array_add(scan->known_apps, create_app_entry(entry->id,
+                                                         entry->name,
+                                                         entry->sort_key));
+    }
+  }
+
+  GTask *task = g_task_new(NULL, NULL, finish_app_discovery, NULL);
+  g_task_set_task_data(task, scan, (GDestroyNotify)free_app_scan);
+  g_task_run_in_thread(task, discover_apps);
+  g_object_unref(task);
+}
+
+// Identifies the same application across rescans
+static char const *app_key(struct app_entry *entry) {
+  return entry->id ? entry->id : entry->name;
+}
+
+static void invalidate_app_row(struct app_entry *entry) {
+  struct row_cache *cache;
+  wl_list_for_each(cache, &row_caches, link) {
+    row_cache_remove(cache, entry->name);
   }
 }
 
-static void output_done(void *data, struct wl_output *wl_output) {
-  struct output *output = data;
-  if (!output->background) {
-    struct background *b = calloc(1, sizeof(*output->background));
-    wl_list_init(&b->buffers);
-    output->background = b;
-    b->output = output;
+// Updates application_list to match the result of a rescan, only touching the
+// entries that were added, removed or changed. Returns true if anything
+// changed
+static bool apply_app_changes(GPtrArray *apps) {
+  GHashTable *found = g_hash_table_new(g_str_hash, g_str_equal);
+  for (guint i = 0; i < apps->len; i++) {
+    g_hash_table_replace(found, (gpointer)app_key(apps->pdata[i]),
+                         apps->pdata[i]);
+  }
 
-    b->surface = wl_compositor_create_surface(compositor);
-    wl_surface_add_listener(b->surface, &background_surface_listener, b);
-    b->base.configure = background_configure;
-    b->base.cursor = "left_ptr";
-    b->base.cursor_x = -1;
-    b->base.cursor_y = -1;
-    b->base.on_cursor_motion = background_cursor_motion;
-    b->base.on_cursor_enter = background_cursor_enter;
-    b->base.on_cursor_leave = background_cursor_leave;
-    b->base.on_pointer_axis = background_pointer_axis;
-    b->base.on_pointer_button = background_pointer_button;
+  bool changed = false;
+  GPtrArray *result = g_ptr_array_sized_new(apps->len);
+  for (guint i = 0; i < application_list->len; i++) {
+    struct app_entry *old_entry = application_list->pdata[i];
+    struct app_entry *new_entry =
+        g_hash_table_lookup(found, app_key(old_entry));
 
-    weston_desktop_shell_set_background(desktop_shell, output->output,
-                                        b->surface);
+    // Entries from the index that haven't been looked up yet, and the ones
+    // an incremental rescan didn't read again, can only be compared by name
+    if (new_entry && strcmp(old_entry->name, new_entry->name) == 0 &&
+        (!old_entry->info || !new_entry->info ||
+         g_strcmp0(g_app_info_get_commandline(old_entry->info),
+                   g_app_info_get_commandline(new_entry->info)) == 0)) {
+      if (!old_entry->info && new_entry->info) {
+        old_entry->info = g_object_ref(new_entry->info);
+      }
+      g_hash_table_remove(found, app_key(old_entry));
+      g_ptr_array_add(result, old_entry);
+      continue;
+    }
+
+    invalidate_app_row(old_entry);
+    if (old_entry->info) {
+      forget_launch_command(old_entry->info);
+    }
+    free_app_entry(old_entry);
+    changed = true;
+  }
+
+  // Anything still left is new, or replaces an entry removed above
+  for (guint i = 0; i < apps->len; i++) {
+    struct app_entry *entry = apps->pdata[i];
+    if (g_hash_table_lookup(found, app_key(entry)) == entry) {
+      g_ptr_array_add(result, entry);
+      changed = true;
+    } else {
+      free_app_entry(entry);
+    }
   }
+
+  if (changed) {
+    g_ptr_array_sort(result, sort_apps);
+  }
+
+  g_hash_table_destroy(found);
+  g_ptr_array_free(apps, TRUE);
+  g_ptr_array_free(application_list, TRUE);
+  application_list = result;
+  return changed;
 }
 
-static void output_scale(void *data, struct wl_output *wl_output,
-                         int32_t factor) {}
+static void finish_app_discovery(GObject *source, GAsyncResult *result,
+                                 gpointer data) {
+  GPtrArray *apps = g_task_propagate_pointer(G_TASK(result), NULL);
+  struct app_scan *scan = g_task_get_task_data(G_TASK(result));
+  discovery_running = false;
+  free_app_dirs(&known_files);
+  known_files = scan->files;
+  scan->files.paths = NULL;
 
-static void output_name(void *data, struct wl_output *wl_output,
-                        const char *name) {}
+  bool changed = true;
+  if (application_list->len) {
+    changed = apply_app_changes(apps);
+  } else {
+    g_ptr_array_free(application_list, TRUE);
+    application_list = apps;
+    launcher_helper_preload();
+  }
+  changed |= update_frequent_apps();
 
-static void output_description(void *data, struct wl_output *wl_output,
-                               const char *description) {}
+  if (changed) {
+    search_index_invalidate();
+    struct output *output;
+    wl_list_for_each(output, &output_list, link) {
+      if (output->background) {
+        menu_reload(output->background->menu);
+      }
+    }
+  }
 
-static const struct wl_output_listener output_listener = {
-    output_geometry, output_mode, output_done,
-    output_scale,    output_name, output_description,
-};
+  if (rescan_pending) {
+    rescan_pending = false;
+    start_app_discovery();
+  }
+}
 
-// XDG WM base
-static void xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base,
-                             uint32_t serial) {
-  xdg_wm_base_pong(xdg_wm_base, serial);
+// GIO doesn't say what changed, so the rescan compares the stamps of the
+// desktop files against the ones the list was read from
+static void app_info_changed(GAppInfoMonitor *monitor, gpointer data) {
+  if (discovery_running) {
+    rescan_pending = true;
+  } else {
+    start_app_discovery();
+  }
 }
 
-static const struct xdg_wm_base_listener xdg_wm_base_listener = {
-    xdg_wm_base_ping,
+// Main loop
+static GMainLoop *main_loop;
+
+// Dispatches Wayland events from the GLib main loop
+struct display_source {
+  GSource base;
+  gpointer fd_tag;
+  bool reading;
 };
 
-// Pointer
-static void pointer_enter(void *data, struct wl_pointer *wl_pointer,
-                          uint32_t serial, struct wl_surface *surface,
-                          wl_fixed_t surface_x, wl_fixed_t surface_y) {
-  struct seat *seat = data;
-  struct desktop_surface *s = wl_surface_get_user_data(surface);
+static gboolean display_source_prepare(GSource *base, gint *timeout) {
+  struct display_source *source = (struct display_source *)base;
+  *timeout = -1;
 
-  seat->pointer.surface = s;
-  if (s->cursor) {
-    set_cursor(s->cursor, seat, serial);
+  // A higher priority source may have prevented check from being called last
+  // time around
+  if (source->reading) {
+    wl_display_cancel_read(display);
+    source->reading = false;
   }
-  s->cursor_x = wl_fixed_to_double(surface_x);
-  s->cursor_y = wl_fixed_to_double(surface_y);
-  if (s->on_cursor_enter) {
-    s->on_cursor_enter(s, seat);
+
+  // Events are already queued, so there is no need to poll
+  if (wl_display_prepare_read(display) != 0) {
+    return TRUE;
   }
-}
+  source->reading = true;
 
-static void pointer_leave(void *data, struct wl_pointer *wl_pointer,
-                          uint32_t serial, struct wl_surface *surface) {
-  struct seat *seat = data;
-  struct desktop_surface *s = wl_surface_get_user_data(surface);
-  s->cursor_x = -1;
-  s->cursor_y = -1;
-  if (s->on_cursor_leave) {
-    s->on_cursor_leave(s, seat);
+  if (wl_display_flush(display) < 0 && errno == EAGAIN) {
+    g_source_modify_unix_fd(base, source->fd_tag, G_IO_IN | G_IO_OUT);
+  } else {
+    g_source_modify_unix_fd(base, source->fd_tag, G_IO_IN);
   }
-  seat->pointer.surface = NULL;
-  current_cursor = NULL;
+  return FALSE;
 }
 
-static void pointer_motion(void *data, struct wl_pointer *wl_pointer,
-                           uint32_t time, wl_fixed_t surface_x,
-                           wl_fixed_t surface_y) {
-  struct seat *seat = data;
-  struct desktop_surface *s = seat->pointer.surface;
-  if (s) {
-    s->cursor_x = wl_fixed_to_double(surface_x);
-    s->cursor_y = wl_fixed_to_double(surface_y);
-    if (s->on_cursor_motion) {
-      s->on_cursor_motion(s, seat);
+static gboolean display_source_check(GSource *base) {
+  struct display_source *source = (struct display_source *)base;
+  GIOCondition revents = g_source_query_unix_fd(base, source->fd_tag);
+
+  if (source->reading) {
+    source->reading = false;
+    if (revents & G_IO_IN) {
+      if (wl_display_read_events(display) < 0) {
+        return TRUE;
+      }
+    } else {
+      wl_display_cancel_read(display);
     }
   }
+
+  return revents != 0;
 }
 
-static void pointer_button(void *data, struct wl_pointer *wl_pointer,
-                           uint32_t serial, uint32_t time, uint32_t button,
-                           uint32_t state) {
-  struct seat *seat = data;
-  struct desktop_surface *s = seat->pointer.surface;
-  if (s && s->on_pointer_button) {
-    s->on_pointer_button(s, seat, button, state);
+static gboolean display_source_dispatch(GSource *base, GSourceFunc callback,
+                                        gpointer data) {
+  struct display_source *source = (struct display_source *)base;
+  GIOCondition revents = g_source_query_unix_fd(base, source->fd_tag);
+
+  TRACE_BEGIN(start);
+  bool failed = (revents & (G_IO_ERR | G_IO_HUP)) ||
+                wl_display_dispatch_pending(display) < 0 ||
+                wl_display_get_error(display);
+  TRACE_END(start, "dispatch");
+  if (failed) {
+    fprintf(stderr, "Lost connection to the display\n");
+    g_main_loop_quit(main_loop);
+    return G_SOURCE_REMOVE;
   }
+
+  return G_SOURCE_CONTINUE;
 }
 
-static void pointer_axis(void *data, struct wl_pointer *wl_pointer,
-                         uint32_t time, uint32_t axis, wl_fixed_t value) {
-  struct seat *seat = data;
-  struct desktop_surface *s = seat->pointer.surface;
-  if (s && s->on_pointer_axis) {
-    s->on_pointer_axis(s, seat, axis, wl_fixed_to_double(value));
-  }
+static GSourceFuncs display_source_funcs = {
+    .prepare = display_source_prepare,
+    .check = display_source_check,
+    .dispatch = display_source_dispatch,
+};
+
+static void add_display_source(void) {
+  GSource *base = g_source_new(&display_source_funcs,
+                               sizeof(struct display_source));
+  struct display_source *source = (struct display_source *)base;
+  source->fd_tag =
+      g_source_add_unix_fd(base, wl_display_get_fd(display), G_IO_IN);
+  g_source_set_name(base, "Wayland display");
+  g_source_attach(base, NULL);
+  g_source_unref(base);
 }
 
-static void pointer_frame(void *data, struct wl_pointer *wl_pointer) {
-  struct seat *seat = data;
-  struct desktop_surface *s = seat->pointer.surface;
-  if (s && s->on_pointer_frame) {
-    s->on_pointer_frame(s, seat);
-  }
+static gboolean quit_signal(gpointer data) {
+  g_main_loop_quit(main_loop);
+  return G_SOURCE_CONTINUE;
 }
 
-static void pointer_axis_source(void *data, struct wl_pointer *wl_pointer,
-                                uint32_t axis_source) {}
+// Benchmark
+//
+// With WESTON_DESKTOP_MATCHBOX_BENCHMARK set to a number of applications, the
+// menu lists that many synthetic applications instead of the installed ones.
+// Once the first menu is on screen, scripted pointer traffic is replayed into
+// it one event per frame: a pointer moving down the rows, wheel scrolling to
+// the end of the list and back, and a touchpad fling. The startup time and the
+// frames drawn in each phase are written to
+// WESTON_DESKTOP_MATCHBOX_BENCHMARK_REPORT, or stdout, and the shell exits.
+// With WESTON_DESKTOP_MATCHBOX_BENCHMARK_HOTPLUG set to a number of cycles,
+// the output of the menu is then dropped and bound again that many times, and
+// the resident memory after the first and the last cycle is reported.
+// scripts/benchmark.sh runs this under weston's headless backend. Only built
+// with the benchmark option, without it the hooks compile to nothing
+#ifdef HAVE_BENCHMARK
+enum benchmark_phase {
+  BENCHMARK_HOVER,
+  BENCHMARK_WHEEL_DOWN,
+  BENCHMARK_WHEEL_UP,
+  BENCHMARK_FLING,
+  BENCHMARK_PHASES,
+};
 
-static void pointer_axis_stop(void *data, struct wl_pointer *wl_pointer,
-                              uint32_t time, uint32_t axis) {}
+static char const *const benchmark_phase_names[] = {
+    [BENCHMARK_HOVER] = "hover",
+    [BENCHMARK_WHEEL_DOWN] = "wheel-down",
+    [BENCHMARK_WHEEL_UP] = "wheel-up",
+    [BENCHMARK_FLING] = "fling",
+};
 
-static void pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer,
-                                  uint32_t axis, int32_t discrete) {}
+// Scrolling per wheel event and per touchpad event, in surface coordinates
+#define BENCHMARK_WHEEL_STEP (15)
+#define BENCHMARK_FINGER_STEP (40)
+// Touchpad events before the fingers lift, and the time between them
+#define BENCHMARK_FINGER_EVENTS (5)
+#define BENCHMARK_FINGER_MS (8)
+// Limit on the events of a phase, in case the menu never reaches the end
+#define BENCHMARK_MAX_STEPS (10000)
 
-static const struct wl_pointer_listener pointer_listener = {
-    pointer_enter,       pointer_leave,     pointer_motion,
-    pointer_button,      pointer_axis,      pointer_frame,
-    pointer_axis_source, pointer_axis_stop, pointer_axis_discrete,
+struct benchmark_stats {
+  gint64 start;
+  gint64 end;
+  unsigned frames;
+  gint64 draw_total;
+  gint64 draw_max;
+  unsigned allocations;
+  ssize_t heap;
 };
 
-// seat
-static void seat_capabilities(void *data, struct wl_seat *wl_seat,
-                              uint32_t capabilities) {
-  struct seat *seat = data;
-  if (capabilities & WL_SEAT_CAPABILITY_POINTER) {
-    seat->pointer.pointer = wl_seat_get_pointer(seat->seat);
-    seat->pointer.surface = NULL;
-    wl_pointer_add_listener(seat->pointer.pointer, &pointer_listener, seat);
+static struct {
+  // Number of synthetic applications, or 0 when not benchmarking
+  guint apps;
+  gint64 start;
+  gint64 list_time;
+  gint64 first_frame;
+  // The menu traffic is replayed into, once it has shown a frame
+  struct menu *menu;
+  // A seat that only exists to point at the menu, and whether it is in
+  // seat_list
+  struct seat seat;
+  bool seat_listed;
+  enum benchmark_phase phase;
+  bool done;
+  unsigned step;
+  // Event time of the synthetic touchpad events
+  uint32_t time;
+  double last_y_scroll;
+  gint64 draw_start;
+  struct benchmark_stats stats[BENCHMARK_PHASES];
+  // Hotplug cycles to run, and those started so far
+  guint hotplug_cycles;
+  guint hotplugs;
+  size_t rss_first;
+  size_t rss_last;
+} benchmark;
+
+// Bytes allocated with malloc, or 0 where that can't be found out
+static size_t benchmark_heap(void) {
+#ifdef __GLIBC__
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// Resident memory of the shell in bytes, or 0 where that can't be found out
+static size_t benchmark_rss(void) {
+  size_t pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*u %zu", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(f);
   }
+  return pages * sysconf(_SC_PAGESIZE);
 }
 
-static void seat_name(void *data, struct wl_seat *wl_seat, const char *name) {}
+// Called first thing in main, so that startup is timed from there
+static void benchmark_init(void) {
+  benchmark.start = g_get_monotonic_time();
+  char const *apps = g_getenv("WESTON_DESKTOP_MATCHBOX_BENCHMARK");
+  if (apps) {
+    benchmark.apps = MAX(atoi(apps), 1);
+  }
+  char const *cycles = g_getenv("WESTON_DESKTOP_MATCHBOX_BENCHMARK_HOTPLUG");
+  if (cycles) {
+    benchmark.hotplug_cycles = MAX(atoi(cycles), 0);
+  }
+}
 
-static const struct wl_seat_listener seat_listener = {
-    seat_capabilities,
-    seat_name,
-};
+// Fills application_list with the synthetic applications, built the same way
+// as those found by discovery
+static void benchmark_load_apps(void) {
+  static char const *const words[] = {
+      "Audio",  "Browser",  "Calculator", "Calendar", "Editor", "Files",
+      "Mail",   "Monitor",  "Music",      "Photos",   "Player", "Settings",
+      "System", "Terminal", "Viewer",     "Writer",
+  };
+  guint n_words = G_N_ELEMENTS(words);
 
-// Registry
-static void registry_global(void *data, struct wl_registry *wl_registry,
-                            uint32_t name, char const *interface,
-                            uint32_t version) {
-  if (strcmp(interface, "wl_compositor") == 0) {
-    compositor = wl_registry_bind(registry, name, &wl_compositor_interface,
-                                  MIN(version, 5));
+  gint64 start = g_get_monotonic_time();
+  for (guint i = 0; i < benchmark.apps; i++) {
+    char *name = g_strdup_printf("%s %s %u", words[i % n_words],
+                                 words[i / n_words % n_words], i);
+    GAppInfo *info = g_app_info_create_from_commandline(
+        "true", name, G_APP_INFO_CREATE_NONE, NULL);
+    if (info) {
+      g_ptr_array_add(application_list, app_entry_from_info(info));
+      g_object_unref(info);
+    }
+    g_free(name);
+  }
+  g_ptr_array_sort(application_list, sort_apps);
+  search_index_build();
+  benchmark.list_time = g_get_monotonic_time() - start;
+}
 
-    cursor_surface = wl_compositor_create_surface(compositor);
+static void benchmark_draw_started(struct menu *menu) {
+  if (menu == benchmark.menu) {
+    benchmark.draw_start = g_get_monotonic_time();
+  }
+}
 
-  } else if (strcmp(interface, "wl_seat") == 0) {
-    struct seat *seat = calloc(1, sizeof(*seat));
-    seat->seat =
-        wl_registry_bind(registry, name, &wl_seat_interface, MIN(version, 5));
-    wl_seat_add_listener(seat->seat, &seat_listener, seat);
+static void benchmark_frame_drawn(struct menu *menu) {
+  if (menu != benchmark.menu || benchmark.done) {
+    return;
+  }
+  struct benchmark_stats *stats = &benchmark.stats[benchmark.phase];
+  gint64 time = g_get_monotonic_time() - benchmark.draw_start;
+  stats->frames++;
+  stats->draw_total += time;
+  stats->draw_max = MAX(stats->draw_max, time);
+}
 
-  } else if (strcmp(interface, "wl_shm") == 0) {
-    shm = wl_registry_bind(registry, name, &wl_shm_interface, MIN(version, 1));
-    wl_shm_add_listener(shm, &shm_listener, NULL);
+static void benchmark_start_phase(enum benchmark_phase phase) {
+  struct benchmark_stats *stats = &benchmark.stats[phase];
+  benchmark.phase = phase;
+  benchmark.step = 0;
+  benchmark.last_y_scroll = benchmark.menu->y_scroll;
+  stats->start = g_get_monotonic_time();
+  stats->allocations = benchmark.menu->swapchain.stats.allocations;
+  stats->heap = benchmark_heap();
+}
 
-    cursor_theme = wl_cursor_theme_load(NULL, 32, shm);
+static void benchmark_end_phase(void) {
+  struct benchmark_stats *stats = &benchmark.stats[benchmark.phase];
+  stats->end = g_get_monotonic_time();
+  stats->allocations =
+      benchmark.menu->swapchain.stats.allocations - stats->allocations;
+  stats->heap = benchmark_heap() - stats->heap;
+}
 
-  } else if (strcmp(interface, "weston_desktop_shell") == 0) {
-    desktop_shell = wl_registry_bind(
-        registry, name, &weston_desktop_shell_interface, MIN(version, 1));
-    weston_desktop_shell_add_listener(desktop_shell, &desktop_shell_listener,
-                                      NULL);
+static void benchmark_write_report(FILE *f) {
+  fprintf(f, "Benchmark with %u applications\n", application_list->len);
+  fprintf(f, "Startup: %.1f ms, building the application list: %.1f ms\n",
+          (benchmark.first_frame - benchmark.start) / 1000.0,
+          benchmark.list_time / 1000.0);
+  fprintf(f, "%-10s %6s %10s %10s %10s %7s %9s\n", "phase", "frames",
+          "frame ms", "draw ms", "max ms", "buffers", "heap KiB");
+  for (int i = 0; i < BENCHMARK_PHASES; i++) {
+    struct benchmark_stats *stats = &benchmark.stats[i];
+    double frames = MAX(stats->frames, 1);
+    fprintf(f, "%-10s %6u %10.3f %10.3f %10.3f %7u %+9zd\n",
+            benchmark_phase_names[i], stats->frames,
+            (stats->end - stats->start) / 1000.0 / frames,
+            stats->draw_total / 1000.0 / frames, stats->draw_max / 1000.0,
+            stats->allocations, stats->heap / 1024);
+  }
+  if (benchmark.hotplug_cycles) {
+    fprintf(f, "Hotplug: %u cycles, resident %zu KiB -> %zu KiB\n",
+            benchmark.hotplug_cycles, benchmark.rss_first / 1024,
+            benchmark.rss_last / 1024);
+  }
+}
 
-  } else if (strcmp(interface, "xdg_wm_base") == 0) {
-    xdg_wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface,
-                                   MIN(version, 4));
-    xdg_wm_base_add_listener(xdg_wm_base, &xdg_wm_base_listener, NULL);
+// Writes the report in one go, so that scripts waiting for the file never see
+// part of it
+static void benchmark_finish(void) {
+  benchmark.done = true;
 
-  } else if (strcmp(interface, "wp_viewporter") == 0) {
-    viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface,
-                                  MIN(version, 1));
+  char const *path = g_getenv("WESTON_DESKTOP_MATCHBOX_BENCHMARK_REPORT");
+  if (!path) {
+    benchmark_write_report(stdout);
+  } else {
+    char *tmp = g_strconcat(path, ".tmp", NULL);
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+      benchmark_write_report(f);
+      if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        perror("Unable to write benchmark report");
+      }
+    } else {
+      perror("Unable to write benchmark report");
+    }
+    g_free(tmp);
+  }
+  g_main_loop_quit(main_loop);
+}
 
-  } else if (strcmp(interface, "wl_output") == 0) {
-    struct output *output = calloc(1, sizeof(*output));
-    output->output =
-        wl_registry_bind(registry, name, &wl_output_interface, MIN(version, 4));
-    wl_output_add_listener(output->output, &output_listener, output);
-    wl_list_insert(&output_list, &output->link);
+static void benchmark_scroll(int32_t source, double dy, bool stop) {
+  struct pointer_scroll scroll = {
+      .source = source,
+      .time = benchmark.time,
+      .dy = dy,
+      .stop = stop,
+  };
+  menu_pointer_scroll(benchmark.menu, &benchmark.seat, &scroll);
+}
 
-    need_roundtrip = true;
-  }
+// Whether scrolling has stopped moving the menu since the last step
+static bool benchmark_scroll_stuck(struct menu *menu) {
+  bool stuck = benchmark.step && !menu->pending_scroll &&
+               menu->y_scroll == benchmark.last_y_scroll;
+  benchmark.last_y_scroll = menu->y_scroll;
+  return stuck;
 }
 
-static void registry_global_remove(void *data, struct wl_registry *wl_registry,
-                                   uint32_t name) {}
+// Sends the next event of the current phase. Returns false once the phase has
+// no more
+static bool benchmark_step(struct menu *menu) {
+  benchmark.time += BENCHMARK_FINGER_MS;
+  switch (benchmark.phase) {
+  case BENCHMARK_HOVER: {
+    // The middle of the next row, until the rows run off the menu
+    double y = menu_row_y(menu, benchmark.step) + menu->extents.height / 2;
+    if (benchmark.step >= menu_row_count(menu) || y >= menu->height) {
+      return false;
+    }
+    benchmark.seat.pointer.y = y / menu->scale;
+    menu_cursor_motion(menu, &benchmark.seat);
+    break;
+  }
+  case BENCHMARK_WHEEL_DOWN:
+  case BENCHMARK_WHEEL_UP:
+    if (benchmark_scroll_stuck(menu)) {
+      return false;
+    }
+    benchmark_scroll(WL_POINTER_AXIS_SOURCE_WHEEL,
+                     benchmark.phase == BENCHMARK_WHEEL_UP
+                         ? -BENCHMARK_WHEEL_STEP
+                         : BENCHMARK_WHEEL_STEP,
+                     false);
+    break;
+  case BENCHMARK_FLING:
+    if (benchmark.step < BENCHMARK_FINGER_EVENTS) {
+      benchmark_scroll(WL_POINTER_AXIS_SOURCE_FINGER, BENCHMARK_FINGER_STEP,
+                       false);
+    } else if (benchmark.step == BENCHMARK_FINGER_EVENTS) {
+      benchmark_scroll(WL_POINTER_AXIS_SOURCE_FINGER, 0, true);
+    } else if (!menu->kinetic_velocity) {
+      return false;
+    }
+    break;
+  default:
+    return false;
+  }
+  return ++benchmark.step < BENCHMARK_MAX_STEPS;
+}
 
-static const struct wl_registry_listener registry_listener = {
-    registry_global,
-    registry_global_remove,
-};
+static void benchmark_release_seat(void) {
+  benchmark.seat.pointer.surface = NULL;
+  menu_cursor_leave(benchmark.menu, &benchmark.seat);
+  wl_list_remove(&benchmark.seat.link);
+  benchmark.seat_listed = false;
+}
 
-static void sigchild_handler(int s) {
-  int status;
-  pid_t pid;
+// Removes the output of the menu and binds its global again, the same as
+// when the output is unplugged and plugged back in. Runs from an idle
+// callback, as the output can't be destroyed from its own frame callback
+static gboolean benchmark_hotplug(gpointer data) {
+  struct output *output;
+  wl_list_for_each(output, &output_list, link) {
+    if (output->background && output->background->menu == benchmark.menu) {
+      uint32_t name = output->name;
+      uint32_t version = wl_output_get_version(output->output);
+      destroy_output(output);
+      registry_global(NULL, registry, name, "wl_output", version);
+      break;
+    }
+  }
+  benchmark.menu = NULL;
+  return G_SOURCE_REMOVE;
+}
 
-  while (pid = waitpid(-1, &status, WNOHANG), pid > 0)
-    fprintf(stderr, "child %d exited\n", pid);
+// A cycle ends with the first frame of the new menu
+static void benchmark_hotplug_frame(struct menu *menu) {
+  if (benchmark.menu) {
+    return;
+  }
+  benchmark.menu = menu;
+  if (benchmark.hotplugs == 1) {
+    benchmark.rss_first = benchmark_rss();
+  }
+  if (benchmark.hotplugs == benchmark.hotplug_cycles) {
+    benchmark.rss_last = benchmark_rss();
+    benchmark_finish();
+    return;
+  }
+  benchmark.hotplugs++;
+  g_idle_add(benchmark_hotplug, NULL);
 }
 
-static int sort_apps(gconstpointer a, gconstpointer b) {
-  GAppInfo *app_a = (GAppInfo *)a;
-  GAppInfo *app_b = (GAppInfo *)b;
+// Drives the replay from the frame callbacks of the menu, so that each event
+// lands on a new frame
+static void benchmark_frame_done(struct menu *menu) {
+  if (!benchmark.apps || benchmark.done) {
+    return;
+  }
+  if (benchmark.hotplugs) {
+    benchmark_hotplug_frame(menu);
+    return;
+  }
+  if (!benchmark.menu) {
+    // The first frame of the first menu to be shown ends startup
+    benchmark.first_frame = g_get_monotonic_time();
+    benchmark.menu = menu;
+    benchmark.seat.pointer.surface = &menu->base;
+    benchmark.seat.pointer.x = menu->logical_width / 2.0;
+    benchmark.seat.pointer.y = -1;
+    wl_list_insert(&seat_list, &benchmark.seat.link);
+    benchmark.seat_listed = true;
+    benchmark_start_phase(BENCHMARK_HOVER);
+  } else if (menu != benchmark.menu) {
+    return;
+  }
+
+  note_activity();
+  while (!benchmark_step(menu)) {
+    benchmark_end_phase();
+    if (benchmark.phase + 1 == BENCHMARK_PHASES) {
+      benchmark_release_seat();
+      if (benchmark.hotplug_cycles) {
+        benchmark.hotplugs = 1;
+        g_idle_add(benchmark_hotplug, NULL);
+      } else {
+        benchmark_finish();
+      }
+      return;
+    }
+    benchmark_start_phase(benchmark.phase + 1);
+  }
 
-  return g_strcmp0(g_app_info_get_name(app_a), g_app_info_get_name(app_b));
+  // Events that didn't change anything still need a frame to send the next
+  menu_request_frame(menu);
 }
+#endif
 
 int main(int argc, char **argv) {
   // setenv("WAYLAND_DEBUG", "client", 0);
+
+  // The helper is forked before anything else, while there are no threads and
+  // nothing but the config file has been opened
+  GKeyFile *keyfile = open_config();
+  if (config_get_bool(keyfile, "launcher-helper", false)) {
+    start_launcher_helper();
+  }
+
+#ifdef HAVE_BENCHMARK
+  benchmark_init();
+  bool benchmarking = benchmark.apps;
+#else
+  bool benchmarking = false;
+#endif
   int ret = 0;
+  struct output *output;
+  struct app_dirs indexed;
   wl_list_init(&output_list);
   wl_list_init(&seat_list);
+  xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
 
-  GList *app_list = g_app_info_get_all();
-  application_list = NULL;
-  for (GList *cur = app_list; cur != NULL; cur = cur->next) {
-    GAppInfo *app = cur->data;
-    if (g_app_info_should_show(app)) {
-      application_list = g_list_insert_sorted(application_list, app, sort_apps);
-      g_object_ref(app);
-    }
+  load_config(keyfile);
+  g_key_file_free(keyfile);
+#ifdef HAVE_TRACING
+  init_tracing();
+#endif
+  load_panel_launchers();
+  load_usage();
+  application_list = g_ptr_array_new();
+
+  // Start looking for applications right away, but don't wait for it to
+  // finish before bringing up the desktop. The index is shown as it is and
+  // only checked once the desktop is up, which rescans if it is out of date.
+  // Benchmarks only show their own applications
+  if (benchmarking) {
+#ifdef HAVE_BENCHMARK
+    benchmark_load_apps();
+#endif
+  } else if (load_app_index(&indexed)) {
+    update_frequent_apps();
+    start_check_app_index(&indexed);
+  } else {
+    start_app_discovery();
   }
-  g_list_free_full(app_list, g_object_unref);
 
   display = wl_display_connect(NULL);
   registry = wl_display_get_registry(display);
 
-  signal(SIGCHLD, sigchild_handler);
+#ifdef HAVE_EGL
+  // Before the outputs are bound so that every menu is created with it
+  init_egl();
+#endif
 
   wl_registry_add_listener(registry, &registry_listener, NULL);
   while (need_roundtrip) {
@@ -685,29 +6935,80 @@ int main(int argc, char **argv) {
     goto done;
   }
 
-  weston_desktop_shell_set_panel_position(
-      desktop_shell, WESTON_DESKTOP_SHELL_PANEL_POSITION_TOP);
+  if (!subcompositor) {
+    fprintf(stderr, "ERROR: subcompositor not found\n");
+    ret = 1;
+    goto done;
+  }
+
+  if (config.panel_position != PANEL_POSITION_NONE) {
+    weston_desktop_shell_set_panel_position(desktop_shell,
+                                            config.panel_position);
+  }
   weston_desktop_shell_desktop_ready(desktop_shell);
 
-  while (true) {
-    if (wl_display_dispatch(display) == -1) {
-      perror("Error dispatching display");
-      break;
-    }
+  if (!benchmarking) {
+    g_signal_connect(g_app_info_monitor_get(), "changed",
+                     G_CALLBACK(app_info_changed), NULL);
   }
 
+  main_loop = g_main_loop_new(NULL, FALSE);
+  add_display_source();
+  g_unix_signal_add(SIGINT, quit_signal, NULL);
+  g_unix_signal_add(SIGTERM, quit_signal, NULL);
+  g_unix_signal_add(SIGUSR1, print_launch_stats, NULL);
+  note_activity();
+
+  g_main_loop_run(main_loop);
+  g_main_loop_unref(main_loop);
+
 done:
-  g_list_free_full(application_list, g_object_unref);
+  wl_list_for_each(output, &output_list, link) {
+    if (output->background) {
+      swapchain_print_stats(&output->background->swapchain, "Background");
+      swapchain_print_stats(&output->background->menu->swapchain, "Menu");
+    }
+  }
+
+  struct output *next_output;
+  wl_list_for_each_safe(output, next_output, &output_list, link) {
+    destroy_output(output);
+  }
+#ifdef HAVE_BENCHMARK
+  // The benchmark's seat isn't allocated, and is still listed if the shell
+  // was stopped partway through
+  if (benchmark.seat_listed) {
+    wl_list_remove(&benchmark.seat.link);
+  }
+#endif
+  struct seat *seat, *next_seat;
+  wl_list_for_each_safe(seat, next_seat, &seat_list, link) {
+    destroy_seat(seat);
+  }
+
+  stop_launcher_helper();
+  finish_usage();
+  free_app_list(application_list);
+  free_app_dirs(&known_files);
+  free_app_list(panel_launchers);
+  stop_panel_clock();
   if (compositor) {
     wl_compositor_destroy(compositor);
   }
+  destroy_cursor_themes();
   if (shm) {
     wl_shm_destroy(shm);
   }
   if (desktop_shell) {
     weston_desktop_shell_destroy(desktop_shell);
   }
+#ifdef HAVE_EGL
+  finish_egl();
+#endif
   wl_registry_destroy(registry);
   wl_display_disconnect(display);
+#ifdef HAVE_TRACING
+  finish_tracing();
+#endif
   return ret;
 }